@@ -0,0 +1,149 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_CANCEL_HPP
+#define UNPAUSE_ASYNC_CANCEL_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Cancellation state shared by the tasks of one group.  Blocks are never
+        // freed, only recycled, so a task may keep a plain pointer to one for as
+        // long as it likes: every cancel() and every recycling bumps generation,
+        // and a task whose captured generation no longer matches is cancelled.
+        struct alignas(cache_line_size) cancel_block {
+            std::atomic<uint64_t> generation { 1 };
+            std::atomic<cancel_block*> parent { nullptr };
+            std::atomic<uint64_t> parent_generation { 0 };
+        };
+
+        class cancel_block_pool {
+        public:
+            // Intentionally leaked so tokens stay readable during static destruction.
+            static cancel_block_pool& instance() {
+                static cancel_block_pool* pool = new cancel_block_pool();
+                return *pool;
+            }
+
+            cancel_block* acquire() {
+                std::lock_guard<spin_lock> lk(lock_);
+                if(free_.empty()) {
+                    auto chunk = new cancel_block[chunk_size];
+                    for(std::size_t i = chunk_size ; i > 0 ; i--) {
+                        free_.push_back(&chunk[i - 1]);
+                    }
+                }
+                auto block = free_.back();
+                free_.pop_back();
+                return block;
+            }
+
+            void release(cancel_block* block) {
+                std::lock_guard<spin_lock> lk(lock_);
+                free_.push_back(block);
+            }
+
+        private:
+            static constexpr std::size_t chunk_size = 64;
+
+            spin_lock lock_;
+            std::vector<cancel_block*> free_;
+        };
+    }
+
+    // Refers to a cancel_group as it was when the token was taken.  Copying and
+    // checking a token only reads the group's cache line, there is no reference
+    // count.  A default constructed token is never cancelled.
+    class cancel_token {
+    public:
+        cancel_token() : block_(nullptr), generation_(0) {};
+
+        bool valid() const { return block_ != nullptr; }
+
+        // True once the group, or any group above it, was cancelled or destroyed
+        // after this token was taken.  O(depth of the group).
+        bool cancelled() const {
+            auto block = block_;
+            auto generation = generation_;
+            while(block) {
+                if(block->generation.load(std::memory_order_acquire) != generation) {
+                    return true;
+                }
+                auto parent = block->parent.load(std::memory_order_relaxed);
+                auto parent_generation = block->parent_generation.load(std::memory_order_relaxed);
+                // the block may have been recycled while its parent was read
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(block->generation.load(std::memory_order_relaxed) != generation) {
+                    return true;
+                }
+                block = parent;
+                generation = parent_generation;
+            }
+            return false;
+        }
+
+    private:
+        friend class cancel_group;
+        cancel_token(detail::cancel_block* block, uint64_t generation) : block_(block), generation_(generation) {};
+
+        detail::cancel_block* block_;
+        uint64_t generation_;
+    };
+
+    // Owner of a cancellation scope.  cancel() cancels every token taken so far
+    // in O(1), including those of subgroups; tokens taken afterwards are live
+    // again.  Subgroups created before a cancel() stay cancelled.  Destroying
+    // the group cancels it.
+    class cancel_group {
+    public:
+        cancel_group() : cancel_group(cancel_token()) {};
+        explicit cancel_group(const cancel_token& parent) : block_(detail::cancel_block_pool::instance().acquire()) {
+            // pairs with the fence in cancel_token::cancelled(): a stale reader
+            // that sees the new parent also sees the bumped generation
+            std::atomic_thread_fence(std::memory_order_release);
+            block_->parent.store(parent.block_, std::memory_order_relaxed);
+            block_->parent_generation.store(parent.generation_, std::memory_order_relaxed);
+        }
+        cancel_group(const cancel_group& other) = delete;
+        cancel_group& operator=(const cancel_group& other) = delete;
+
+        ~cancel_group() {
+            cancel();
+            detail::cancel_block_pool::instance().release(block_);
+        }
+
+        cancel_token token() const {
+            return cancel_token(block_, block_->generation.load(std::memory_order_acquire));
+        }
+
+        void cancel() {
+            block_->generation.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        // True when a group above this one was cancelled, so new tokens are
+        // born cancelled.
+        bool cancelled() const { return token().cancelled(); }
+
+    private:
+        detail::cancel_block* block_;
+    };
+}
+}
+
+#endif /* UNPAUSE_ASYNC_CANCEL_HPP */
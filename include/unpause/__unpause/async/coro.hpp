@@ -0,0 +1,262 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_CORO_HPP
+#define UNPAUSE_ASYNC_CORO_HPP
+
+// Coroutine support, only available when compiling as C++20 or later.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#define UNPAUSE_ASYNC_HAS_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <chrono>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        struct co_promise_base {
+            struct final_awaiter {
+                bool await_ready() const noexcept { return false; }
+                template<class P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+                    auto c = h.promise().continuation;
+                    return c ? c : std::noop_coroutine();
+                }
+                void await_resume() const noexcept {}
+            };
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            final_awaiter final_suspend() noexcept { return {}; }
+            void unhandled_exception() { error = std::current_exception(); }
+
+            std::coroutine_handle<> continuation;
+            co_promise_base* parent { nullptr }; // promise of continuation, when it is a co_task
+            std::exception_ptr error;
+        };
+
+        // The frame to destroy when h will never be resumed: the outermost
+        // coroutine of a chain of co_tasks awaiting each other, which owns the
+        // others.  Destroying it completes a co_spawn future with broken_promise.
+        template<class P>
+        std::coroutine_handle<> abandon_root(std::coroutine_handle<P> h) {
+            if constexpr (std::is_base_of<co_promise_base, P>::value) {
+                std::coroutine_handle<> root = h;
+                for(co_promise_base* p = &h.promise() ; p && p->continuation ; p = p->parent) {
+                    root = p->continuation;
+                }
+                return root;
+            } else {
+                return h;
+            }
+        }
+
+        // Resumes a suspended coroutine.  Small enough to be stored inline in a
+        // task_ptr, so a suspension point does not allocate.  Dropped unrun (the
+        // queue was closed or the pool is exiting) or cancelled, it destroys the
+        // coroutine instead, so the frame does not leak.
+        struct resume_task : public task_container {
+            resume_task(std::coroutine_handle<> h, std::coroutine_handle<> root) : handle(h), root(root) {};
+            resume_task(resume_task&& other) noexcept
+            : task_container(std::move(other)), handle(std::exchange(other.handle, nullptr)), root(std::exchange(other.root, nullptr)) {};
+            ~resume_task() {
+                if(handle) {
+                    root.destroy();
+                }
+            }
+            virtual void run_v() {
+                auto h = std::exchange(handle, nullptr);
+                if(token.cancelled()) {
+                    root.destroy();
+                } else {
+                    h.resume();
+                }
+            }
+            std::coroutine_handle<> handle;
+            std::coroutine_handle<> root;
+        };
+
+        struct pool_awaiter {
+            bool await_ready() const noexcept { return false; }
+            template<class P>
+            void await_suspend(std::coroutine_handle<P> h) {
+                pool.submit(task_ptr::make<resume_task>(h, abandon_root(h)));
+            }
+            void await_resume() const noexcept {}
+
+            thread_pool& pool;
+        };
+
+        struct queue_awaiter {
+            bool await_ready() const noexcept { return false; }
+            template<class P>
+            void await_suspend(std::coroutine_handle<P> h) {
+                // the frame, this awaiter included, may be gone once the task is queued
+                auto& p = pool;
+                auto& q = queue;
+                resume_task t(h, abandon_root(h));
+                if(!q.complete.load()) {
+                    detail::run_strand(p, q.strand(), q.cancellation.token(), t);
+                }
+            }
+            void await_resume() const noexcept {}
+
+            thread_pool& pool;
+            task_queue& queue;
+        };
+
+        struct run_loop_awaiter {
+            bool await_ready() const noexcept { return point <= std::chrono::steady_clock::now(); }
+            template<class P>
+            void await_suspend(std::coroutine_handle<P> h) {
+                auto t = task_ptr::make<resume_task>(h, abandon_root(h));
+                t->dispatch_time = point;
+                loop.add(std::move(t));
+            }
+            void await_resume() const noexcept {}
+
+            run_loop& loop;
+            std::chrono::steady_clock::time_point point;
+        };
+    }
+
+    // co_await schedule_on(pool): continue on one of the pool's workers.
+    inline detail::pool_awaiter schedule_on(thread_pool& pool) {
+        return detail::pool_awaiter { pool };
+    }
+
+    // co_await schedule_on(pool, queue): continue on the pool, serialised with
+    // everything else running through queue.
+    inline detail::queue_awaiter schedule_on(thread_pool& pool, task_queue& queue) {
+        return detail::queue_awaiter { pool, queue };
+    }
+
+    // co_await sleep_until(loop, point): continue on the loop's thread at point.
+    inline detail::run_loop_awaiter sleep_until(run_loop& loop, std::chrono::steady_clock::time_point point) {
+        return detail::run_loop_awaiter { loop, point };
+    }
+
+    template<class T = void>
+    class co_task;
+
+    namespace detail {
+        template<class T>
+        struct co_promise : co_promise_base {
+            co_task<T> get_return_object();
+            template<class V>
+            void return_value(V&& v) { value.emplace(std::forward<V>(v)); }
+            T result() {
+                if(error) {
+                    std::rethrow_exception(error);
+                }
+                return std::move(*value);
+            }
+            std::optional<T> value;
+        };
+
+        template<>
+        struct co_promise<void> : co_promise_base {
+            co_task<void> get_return_object();
+            void return_void() {}
+            void result() {
+                if(error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        };
+    }
+
+    // Lazily started coroutine.  Awaiting it starts it and resumes the awaiter
+    // by symmetric transfer when it finishes, without going through a queue.
+    template<class T>
+    class co_task
+    {
+    public:
+        using promise_type = detail::co_promise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        co_task(co_task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {};
+        co_task(const co_task& other) = delete;
+        ~co_task() {
+            if(handle_) {
+                handle_.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiting) noexcept {
+            handle_.promise().continuation = awaiting;
+            if constexpr (std::is_base_of<detail::co_promise_base, P>::value) {
+                handle_.promise().parent = &awaiting.promise();
+            }
+            return handle_;
+        }
+        T await_resume() { return handle_.promise().result(); }
+
+    private:
+        explicit co_task(handle_type h) : handle_(h) {};
+        friend struct detail::co_promise<T>;
+
+        handle_type handle_;
+    };
+
+    namespace detail {
+        template<class T>
+        co_task<T> co_promise<T>::get_return_object() { return co_task<T>(co_task<T>::handle_type::from_promise(*this)); }
+
+        inline co_task<void> co_promise<void>::get_return_object() { return co_task<void>(co_task<void>::handle_type::from_promise(*this)); }
+
+        struct detached {
+            struct promise_type {
+                detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+        template<class T>
+        detached co_spawn_into(thread_pool& pool, co_task<T> t, promise<T> p) {
+            co_await schedule_on(pool);
+            try {
+                if constexpr (std::is_void<T>::value) {
+                    co_await t;
+                    p.set_value();
+                } else {
+                    p.set_value(co_await t);
+                }
+            } catch(...) {
+                p.set_exception(std::current_exception());
+            }
+        }
+    }
+
+    // Starts t on the pool and returns a future for its result.
+    template<class T>
+    future<T> co_spawn(thread_pool& pool, co_task<T> t) {
+        promise<T> p;
+        p.set_pool(&pool);
+        auto f = p.get_future();
+        detail::co_spawn_into(pool, std::move(t), std::move(p));
+        return f;
+    }
+}
+}
+
+#endif
+
+#endif /* UNPAUSE_ASYNC_CORO_HPP */
@@ -0,0 +1,119 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_DEADLINE_QUEUE_HPP
+#define UNPAUSE_ASYNC_DEADLINE_QUEUE_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+#include <unpause/__unpause/async/timer_heap.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Tasks ordered by task->dispatch_time, earliest first, shared by many
+        // producers and consumers.  Tasks are spread over a few heaps, each
+        // behind its own spin_lock and publishing its earliest deadline; pop()
+        // takes from the heap with the earliest published deadline.  The order
+        // across heaps is therefore approximate under contention, but no lock
+        // is shared by every thread.
+        class deadline_queue {
+        public:
+            explicit deadline_queue(std::size_t shards) : count_(shards ? shards : 1), shards_(std::make_unique<shard[]>(count_)) {};
+            deadline_queue(const deadline_queue& other) = delete;
+            deadline_queue& operator=(const deadline_queue& other) = delete;
+
+            // hint spreads producers over the heaps, e.g. the worker index.
+            void push(task_ptr&& task, std::size_t hint) {
+                auto& s = shards_[hint % count_];
+                auto deadline = task->dispatch_time;
+                std::lock_guard<spin_lock> lk(s.lock);
+                s.heap.push(deadline, std::move(task));
+                s.publish();
+            }
+
+            task_ptr pop() {
+                for(std::size_t attempt = 0 ; attempt < count_ ; attempt++) {
+                    std::size_t best = count_;
+                    int64_t earliest = 0;
+                    for(std::size_t i = 0 ; i < count_ ; i++) {
+                        if(shards_[i].empty.load(std::memory_order_acquire)) {
+                            continue;
+                        }
+                        auto top = shards_[i].top.load(std::memory_order_relaxed);
+                        if(best == count_ || top < earliest) {
+                            earliest = top;
+                            best = i;
+                        }
+                    }
+                    if(best == count_) {
+                        return task_ptr();
+                    }
+                    auto& s = shards_[best];
+                    std::lock_guard<spin_lock> lk(s.lock);
+                    if(!s.heap.empty()) {
+                        auto task = s.heap.pop();
+                        s.publish();
+                        return task;
+                    }
+                }
+                return task_ptr();
+            }
+
+            bool empty() const {
+                for(std::size_t i = 0 ; i < count_ ; i++) {
+                    if(!shards_[i].empty.load(std::memory_order_acquire)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            std::size_t size() {
+                std::size_t res = 0;
+                for(std::size_t i = 0 ; i < count_ ; i++) {
+                    std::lock_guard<spin_lock> lk(shards_[i].lock);
+                    res += shards_[i].heap.size();
+                }
+                return res;
+            }
+
+        private:
+            // Emptiness is kept apart from the top deadline: every deadline,
+            // time_point::max() included, is a valid one.
+            struct alignas(cache_line_size) shard {
+                void publish() {
+                    if(!heap.empty()) {
+                        top.store(heap.top_deadline().time_since_epoch().count(), std::memory_order_relaxed);
+                    }
+                    empty.store(heap.empty(), std::memory_order_release);
+                }
+
+                spin_lock lock;
+                timer_heap<task_ptr> heap;
+                std::atomic<int64_t> top { 0 };
+                std::atomic<bool> empty { true };
+            };
+
+            std::size_t count_;
+            std::unique_ptr<shard[]> shards_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_DEADLINE_QUEUE_HPP */
@@ -0,0 +1,125 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_EVENT_COUNT_HPP
+#define UNPAUSE_ASYNC_EVENT_COUNT_HPP
+
+#include <unpause/__unpause/async/futex.hpp>
+
+#include <cstdint>
+#include <climits>
+#include <chrono>
+#include <atomic>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Lets threads park until some condition they cannot wait on directly
+        // (e.g. a queue becoming non-empty) may have changed.
+        //
+        //   waiter:   auto key = ec.prepare_wait();
+        //             if(condition()) { ec.cancel_wait(); } else { ec.wait(key); }
+        //   notifier: make condition() true; ec.notify(n);
+        //
+        // notify() is a couple of loads when nobody is parked.
+        class event_count {
+        public:
+            event_count() : epoch_(0), waiters_(0) {};
+
+            uint32_t prepare_wait() {
+                waiters_.fetch_add(1, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return epoch_.load(std::memory_order_acquire);
+            }
+
+            void cancel_wait() {
+                waiters_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            void wait(uint32_t key) {
+                while(epoch_.load(std::memory_order_acquire) == key) {
+                    futex_wait(epoch_, key);
+                }
+                waiters_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            // Like wait(), returning false if nothing was notified within timeout.
+            bool wait_for(uint32_t key, std::chrono::nanoseconds timeout) {
+                auto deadline = std::chrono::steady_clock::now() + timeout;
+                bool notified = true;
+                while(epoch_.load(std::memory_order_acquire) == key) {
+                    auto now = std::chrono::steady_clock::now();
+                    if(now >= deadline) {
+                        notified = false;
+                        break;
+                    }
+                    futex_wait_for(epoch_, key, deadline - now);
+                }
+                waiters_.fetch_sub(1, std::memory_order_relaxed);
+                return notified;
+            }
+
+            // Wakes up to count parked threads.  Threads between prepare_wait()
+            // and wait() always see the notification.
+            void notify(int count = 1) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(waiters_.load(std::memory_order_relaxed) == 0) {
+                    return;
+                }
+                epoch_.fetch_add(1, std::memory_order_release);
+                futex_wake(epoch_, count);
+            }
+
+            void notify_all() {
+                notify(INT_MAX);
+            }
+
+            uint32_t waiters() const { return waiters_.load(std::memory_order_relaxed); }
+
+            // For notifiers that changed the condition with a seq_cst
+            // read-modify-write: lets them skip notify() and its fence when
+            // nobody can be waiting.
+            bool has_waiters() const { return waiters_.load(std::memory_order_seq_cst) != 0; }
+
+            // Blocks until done() holds or deadline passes; returns done().
+            template<class Done>
+            bool wait_until(Done&& done, std::chrono::steady_clock::time_point deadline) {
+                for(;;) {
+                    if(done()) {
+                        return true;
+                    }
+                    auto key = prepare_wait();
+                    if(done()) {
+                        cancel_wait();
+                        return true;
+                    }
+                    if(deadline == std::chrono::steady_clock::time_point::max()) {
+                        wait(key);
+                        continue;
+                    }
+                    auto now = std::chrono::steady_clock::now();
+                    if(now >= deadline) {
+                        cancel_wait();
+                        return done();
+                    }
+                    wait_for(key, deadline - now);
+                }
+            }
+
+        private:
+            std::atomic<uint32_t> epoch_;
+            std::atomic<uint32_t> waiters_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_EVENT_COUNT_HPP */
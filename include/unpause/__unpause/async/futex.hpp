@@ -0,0 +1,143 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_FUTEX_HPP
+#define UNPAUSE_ASYNC_FUTEX_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <chrono>
+#include <climits>
+#include <atomic>
+#include <mutex>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Block while word == expected.  May return spuriously, callers re-check.
+        // On Linux this is a private futex, elsewhere a striped table of
+        // condition variables keyed by address.
+#if defined(__linux__)
+        inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+        }
+
+        inline void futex_wake(std::atomic<uint32_t>& word, int count = INT_MAX) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+        }
+
+        // Like futex_wait, giving up after roughly timeout.
+        inline void futex_wait_for(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+            auto ns = timeout.count() > 0 ? timeout.count() : 0;
+            struct timespec ts;
+            ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+            ts.tv_nsec = static_cast<long>(ns % 1000000000);
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+        }
+#else
+        struct futex_bucket {
+            std::mutex mutex;
+            std::condition_variable cond;
+        };
+
+        inline futex_bucket& futex_bucket_for(const void* address) {
+            static futex_bucket buckets[64];
+            return buckets[(reinterpret_cast<uintptr_t>(address) >> 4) % 64];
+        }
+
+        inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected) {
+            auto& bucket = futex_bucket_for(&word);
+            std::unique_lock<std::mutex> lk(bucket.mutex);
+            if(word.load(std::memory_order_acquire) == expected) {
+                bucket.cond.wait(lk);
+            }
+        }
+
+        inline void futex_wake(std::atomic<uint32_t>& word, int count = INT_MAX) {
+            auto& bucket = futex_bucket_for(&word);
+            std::lock_guard<std::mutex> lk(bucket.mutex);
+            (void)count;
+            bucket.cond.notify_all();
+        }
+
+        inline void futex_wait_for(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+            auto& bucket = futex_bucket_for(&word);
+            std::unique_lock<std::mutex> lk(bucket.mutex);
+            if(word.load(std::memory_order_acquire) == expected) {
+                bucket.cond.wait_for(lk, timeout);
+            }
+        }
+#endif
+
+        // Counts calls in progress; wait_until() blocks until none is left.
+        // leave() only uses the counter's address after releasing the last
+        // call, so the owner may be destroyed as soon as a waiter returns.
+        class inflight_latch {
+        public:
+            inflight_latch() : word_(0) {};
+
+            void enter() { word_.fetch_add(1, std::memory_order_acq_rel); }
+
+            void leave() {
+                auto prev = word_.fetch_sub(1, std::memory_order_acq_rel);
+                if((prev & count_mask) == 1 && (prev >> waiter_shift)) {
+                    futex_wake(word_);
+                }
+            }
+
+            uint32_t count() const { return word_.load(std::memory_order_acquire) & count_mask; }
+
+            bool wait_until(std::chrono::steady_clock::time_point deadline) {
+                if(count() == 0) {
+                    return true;
+                }
+                word_.fetch_add(waiter_one, std::memory_order_acq_rel);
+                bool res = true;
+                for(;;) {
+                    auto value = word_.load(std::memory_order_acquire);
+                    if((value & count_mask) == 0) {
+                        break;
+                    }
+                    if(deadline == std::chrono::steady_clock::time_point::max()) {
+                        futex_wait(word_, value);
+                        continue;
+                    }
+                    auto now = std::chrono::steady_clock::now();
+                    if(now >= deadline) {
+                        res = false;
+                        break;
+                    }
+                    futex_wait_for(word_, value, deadline - now);
+                }
+                word_.fetch_sub(waiter_one, std::memory_order_acq_rel);
+                return res;
+            }
+
+        private:
+            // low bits count calls, high bits count waiters
+            static constexpr uint32_t waiter_shift = 20;
+            static constexpr uint32_t count_mask = (1u << waiter_shift) - 1;
+            static constexpr uint32_t waiter_one = 1u << waiter_shift;
+
+            std::atomic<uint32_t> word_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_FUTEX_HPP */
@@ -0,0 +1,431 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_FUTURE_HPP
+#define UNPAUSE_ASYNC_FUTURE_HPP
+
+#include <unpause/__unpause/async/futex.hpp>
+#include <unpause/__unpause/async/spin_lock.hpp>
+
+#include <type_traits>
+#include <stdexcept>
+#include <exception>
+#include <optional>
+#include <cstdint>
+#include <utility>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <new>
+
+namespace unpause { namespace async {
+
+    template<class T> class future;
+    template<class T> class promise;
+
+    // Tag selecting the run() overloads that return a future.
+    struct use_future_t {};
+    constexpr use_future_t use_future {};
+
+    namespace detail {
+        struct unit {};
+
+        template<class T>
+        using future_value_t = std::conditional_t<std::is_void<T>::value, unit, T>;
+
+        // Result slot, continuation and wait word of a promise/future pair, all in
+        // one intrusively counted allocation.  Waiters block on a futex, they do
+        // not need a mutex or condition variable.
+        template<class T>
+        class shared_state {
+        public:
+            using value_type = future_value_t<T>;
+
+            shared_state() : pool(nullptr), refs_(1), status_(0), has_value_(false) {};
+            shared_state(const shared_state& other) = delete;
+            shared_state& operator=(const shared_state& other) = delete;
+
+            ~shared_state() {
+                if(has_value_) {
+                    value()->~value_type();
+                }
+            }
+
+            void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+            void release() {
+                if(refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    delete this;
+                }
+            }
+
+            template<class... V>
+            void set_value(V&&... v) {
+                ::new (storage_) value_type(std::forward<V>(v)...);
+                has_value_ = true;
+                publish();
+            }
+
+            void set_exception(std::exception_ptr e) {
+                error_ = std::move(e);
+                publish();
+            }
+
+            bool ready() const { return status_.load(std::memory_order_acquire) & ready_bit; }
+
+            void wait() {
+                for(int i = 0 ; i < 64 && !ready() ; i++) {
+                    cpu_relax();
+                }
+                uint32_t s = status_.load(std::memory_order_acquire);
+                while(!(s & ready_bit)) {
+                    if(!(s & waiter_bit) && !status_.compare_exchange_weak(s, s | waiter_bit, std::memory_order_acq_rel)) {
+                        continue;
+                    }
+                    futex_wait(status_, s | waiter_bit);
+                    s = status_.load(std::memory_order_acquire);
+                }
+            }
+
+            // Runs c once the value is set, immediately if it already is.
+            void set_continuation(small_function<void()>&& c) {
+                continuation_ = std::move(c);
+                if(status_.fetch_or(continuation_bit, std::memory_order_acq_rel) & ready_bit) {
+                    run_continuation();
+                }
+            }
+
+            value_type take() {
+                if(error_) {
+                    std::rethrow_exception(error_);
+                }
+                return std::move(*value());
+            }
+
+            std::exception_ptr error() const { return error_; }
+
+            thread_pool* pool; // where continuations run, inline when null
+
+        private:
+            static constexpr uint32_t ready_bit = 1;
+            static constexpr uint32_t continuation_bit = 2;
+            static constexpr uint32_t waiter_bit = 4;
+
+            void publish() {
+                auto old = status_.fetch_or(ready_bit, std::memory_order_acq_rel);
+                if(old & waiter_bit) {
+                    futex_wake(status_);
+                }
+                if(old & continuation_bit) {
+                    run_continuation();
+                }
+            }
+
+            void run_continuation() {
+                auto c = std::move(continuation_);
+                c();
+            }
+
+            value_type* value() { return std::launder(reinterpret_cast<value_type*>(storage_)); }
+
+            std::atomic<uint32_t> refs_;
+            std::atomic<uint32_t> status_;
+            bool has_value_;
+            std::exception_ptr error_;
+            small_function<void()> continuation_;
+            alignas(value_type) unsigned char storage_[sizeof(value_type)];
+        };
+
+        template<class T>
+        class state_ref {
+        public:
+            state_ref() : state_(nullptr) {};
+            explicit state_ref(shared_state<T>* state) : state_(state) {};
+            state_ref(const state_ref& other) : state_(other.state_) { if(state_) { state_->retain(); } }
+            state_ref(state_ref&& other) noexcept : state_(other.state_) { other.state_ = nullptr; }
+            ~state_ref() { if(state_) { state_->release(); } }
+            state_ref& operator=(state_ref other) noexcept { std::swap(state_, other.state_); return *this; }
+
+            shared_state<T>* operator->() const { return state_; }
+            shared_state<T>* get() const { return state_; }
+            explicit operator bool() const { return state_ != nullptr; }
+
+        private:
+            shared_state<T>* state_;
+        };
+
+        template<class T, class F>
+        void set_from(promise<T>& p, F&& f);
+
+        struct future_access;
+    }
+
+    template<class T>
+    class promise
+    {
+    public:
+        promise() : state_(new detail::shared_state<T>()), retrieved_(false) {};
+        promise(promise&& other) noexcept = default;
+        promise& operator=(promise&& other) noexcept = default;
+        promise(const promise& other) = delete;
+
+        ~promise() {
+            if(state_ && !state_->ready()) {
+                state_->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+            }
+        }
+
+        future<T> get_future() {
+            if(retrieved_) {
+                throw std::future_error(std::future_errc::future_already_retrieved);
+            }
+            retrieved_ = true;
+            return future<T>(state_);
+        }
+
+        template<class... V>
+        void set_value(V&&... v) {
+            state_->set_value(std::forward<V>(v)...);
+        }
+
+        void set_exception(std::exception_ptr e) {
+            state_->set_exception(std::move(e));
+        }
+
+        void set_pool(thread_pool* pool) { state_->pool = pool; }
+
+    private:
+        detail::state_ref<T> state_;
+        bool retrieved_;
+    };
+
+    template<class T>
+    class future
+    {
+    public:
+        future() {};
+        future(future&& other) noexcept = default;
+        future& operator=(future&& other) noexcept = default;
+        future(const future& other) = delete;
+
+        bool valid() const { return static_cast<bool>(state_); }
+        bool is_ready() const { return state_ && state_->ready(); }
+
+        void wait() const { state_->wait(); }
+
+        T get() {
+            auto state = std::move(state_);
+            state->wait();
+            if constexpr (std::is_void<T>::value) {
+                state->take();
+            } else {
+                return state->take();
+            }
+        }
+
+        // Attaches a continuation that receives the value once it is set.  It is
+        // posted to the pool that produced this future, or run inline when there
+        // is none.  Exceptions skip the continuation and propagate to the result.
+        // Consumes this future.
+        template<class F>
+        auto then(F&& f) {
+            using result_type = typename continuation_result<F>::type;
+            promise<result_type> p;
+            auto next = p.get_future();
+            auto pool = state_->pool;
+            p.set_pool(pool);
+            auto state = std::move(state_);
+            auto raw = state.get();
+            raw->set_continuation([state = std::move(state), p = std::move(p), f = std::forward<F>(f), pool]() mutable {
+                auto work = [state = std::move(state), p = std::move(p), f = std::move(f)]() mutable {
+                    if(state->error()) {
+                        p.set_exception(state->error());
+                        return;
+                    }
+                    detail::set_from(p, [&]() -> result_type {
+                        if constexpr (std::is_void<T>::value) {
+                            return f();
+                        } else {
+                            return f(state->take());
+                        }
+                    });
+                };
+                if(pool) {
+                    run(*pool, std::move(work));
+                } else {
+                    work();
+                }
+            });
+            return next;
+        }
+
+    private:
+        template<class F, class U = T>
+        struct continuation_result { using type = std::invoke_result_t<F, U>; };
+        template<class F>
+        struct continuation_result<F, void> { using type = std::invoke_result_t<F>; };
+
+        explicit future(detail::state_ref<T> state) : state_(std::move(state)) {};
+        friend class promise<T>;
+        friend struct detail::future_access;
+
+        detail::state_ref<T> state_;
+    };
+
+    namespace detail {
+        template<class T, class F>
+        void set_from(promise<T>& p, F&& f) {
+            try {
+                if constexpr (std::is_void<T>::value) {
+                    f();
+                    p.set_value();
+                } else {
+                    p.set_value(f());
+                }
+            } catch(...) {
+                p.set_exception(std::current_exception());
+            }
+        }
+    }
+
+    namespace detail {
+        // Lets the combinators wait on a future's state without going through
+        // then(), which would post every completion to the pool.
+        struct future_access {
+            template<class T>
+            static state_ref<T> take(future<T>& f) { return std::move(f.state_); }
+        };
+
+        template<class T>
+        struct when_all_state {
+            using result_type = std::conditional_t<std::is_void<T>::value, void, std::vector<T>>;
+
+            explicit when_all_state(std::size_t count) : remaining(count), values(std::is_void<T>::value ? 0 : count) {};
+
+            void complete(std::size_t index, shared_state<T>& state) {
+                if(state.error()) {
+                    std::lock_guard<spin_lock> lk(lock);
+                    if(!error) {
+                        error = state.error();
+                    }
+                } else if constexpr (!std::is_void<T>::value) {
+                    values[index].emplace(state.take());
+                }
+                if(remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    finish();
+                }
+            }
+
+            void finish() {
+                if(error) {
+                    p.set_exception(error);
+                } else if constexpr (std::is_void<T>::value) {
+                    p.set_value();
+                } else {
+                    std::vector<T> out;
+                    out.reserve(values.size());
+                    for(auto & it : values) {
+                        out.push_back(std::move(*it));
+                    }
+                    p.set_value(std::move(out));
+                }
+            }
+
+            promise<result_type> p;
+            std::atomic<std::size_t> remaining;
+            std::vector<std::optional<future_value_t<T>>> values;
+            spin_lock lock;
+            std::exception_ptr error;
+        };
+
+        template<class T>
+        struct when_any_state {
+            using result_type = std::conditional_t<std::is_void<T>::value, std::size_t, std::pair<std::size_t, T>>;
+
+            void complete(std::size_t index, shared_state<T>& state) {
+                if(done.exchange(true, std::memory_order_acq_rel)) {
+                    return;
+                }
+                if(state.error()) {
+                    p.set_exception(state.error());
+                } else if constexpr (std::is_void<T>::value) {
+                    p.set_value(index);
+                } else {
+                    p.set_value(result_type(index, state.take()));
+                }
+            }
+
+            promise<result_type> p;
+            std::atomic<bool> done { false };
+        };
+
+        template<class State, class T>
+        auto combine(std::shared_ptr<State> state, std::vector<future<T>>& futures) {
+            auto res = state->p.get_future();
+            thread_pool* pool = nullptr;
+            for(std::size_t i = 0 ; i < futures.size() ; i++) {
+                auto ref = future_access::take(futures[i]);
+                if(!ref) {
+                    throw std::future_error(std::future_errc::no_state);
+                }
+                if(!pool) {
+                    pool = ref->pool;
+                    state->p.set_pool(pool);
+                }
+                auto raw = ref.get();
+                // completions run inline on the thread that sets each value
+                raw->set_continuation([state, i, ref = std::move(ref)]() mutable {
+                    state->complete(i, *ref.get());
+                });
+            }
+            return res;
+        }
+    }
+
+    // Completes once every future has, with their values in order (nothing for
+    // void), or with the first exception seen.  Consumes the futures.
+    template<class T>
+    auto when_all(std::vector<future<T>> futures) {
+        auto state = std::make_shared<detail::when_all_state<T>>(futures.size());
+        if(futures.empty()) {
+            auto res = state->p.get_future();
+            state->finish();
+            return res;
+        }
+        return detail::combine(std::move(state), futures);
+    }
+
+    // Completes with the first future to complete: its index (and value), or its
+    // exception.  The other results are dropped.  Consumes the futures.
+    template<class T>
+    auto when_any(std::vector<future<T>> futures) {
+        if(futures.empty()) {
+            throw std::invalid_argument("when_any needs at least one future");
+        }
+        return detail::combine(std::make_shared<detail::when_any_state<T>>(), futures);
+    }
+
+    // run(thread_pool, use_future...)
+    template<class R, class... Args>
+    auto run(thread_pool& pool, use_future_t, R&& r, Args&&... a) {
+        using result_type = std::invoke_result_t<std::decay_t<R>, std::decay_t<Args>...>;
+        promise<result_type> p;
+        p.set_pool(&pool);
+        auto f = p.get_future();
+        run(pool, [p = std::move(p), r = std::forward<R>(r)](std::decay_t<Args>... args) mutable {
+            detail::set_from(p, [&]() -> result_type { return r(std::move(args)...); });
+        }, std::decay_t<Args>(std::forward<Args>(a))...);
+        return f;
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_FUTURE_HPP */
@@ -0,0 +1,311 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_GRAPH_HPP
+#define UNPAUSE_ASYNC_GRAPH_HPP
+
+#include <unpause/__unpause/async/futex.hpp>
+
+#include <initializer_list>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+namespace unpause { namespace async {
+
+    class task_graph;
+
+    namespace detail {
+        // Pool task running one node of a graph, small enough to stay inline in
+        // a task_ptr so dispatching a node does not allocate.
+        struct graph_node_task : public task_container {
+            graph_node_task(task_graph& graph, std::size_t node) : graph(graph), node(node) {};
+            graph_node_task(graph_node_task&& other) noexcept : task_container(std::move(other)), graph(other.graph), node(other.node) {};
+            virtual void run_v();
+
+            task_graph& graph;
+            std::size_t node;
+        };
+    }
+
+    // Tasks with dependencies, run on a thread_pool.  A node is dispatched as
+    // soon as its last predecessor finishes, by the worker that finished it:
+    // the ready successor with the longest remaining (weighted) path runs next
+    // on that worker and the others are submitted to the pool in one batch,
+    // ordered so that the longest path is taken first (from the shared queue,
+    // or from the worker's own deque with work_stealing), so the critical path
+    // never waits behind shorter branches.  Nothing
+    // polls for completion, the last node to finish wakes the caller.
+    //
+    // The graph can be run again once a run has completed; the structure is
+    // only re-analysed after nodes or edges were added.  One run at a time.
+    class task_graph
+    {
+    public:
+        using node_id = std::size_t;
+
+        task_graph() : remaining_(0), finished_(1), failed_(false), prepared_(true) {};
+        task_graph(const task_graph& other) = delete;
+        task_graph& operator=(const task_graph& other) = delete;
+
+        // weight is the relative cost of the node, used to find the critical path.
+        template<class F>
+        node_id add(F&& f, std::size_t weight = 1) {
+            nodes_.emplace_back(std::forward<F>(f), weight);
+            prepared_ = false;
+            return nodes_.size() - 1;
+        }
+
+        template<class F>
+        node_id add(F&& f, std::initializer_list<node_id> dependencies, std::size_t weight = 1) {
+            auto id = add(std::forward<F>(f), weight);
+            for(auto it : dependencies) {
+                precede(it, id);
+            }
+            return id;
+        }
+
+        // before must finish before after starts.
+        void precede(node_id before, node_id after) {
+            if(before >= nodes_.size() || after >= nodes_.size() || before == after) {
+                throw std::invalid_argument("task_graph: bad edge");
+            }
+            nodes_[before].successors.push_back(after);
+            nodes_[after].dependencies++;
+            prepared_ = false;
+        }
+
+        std::size_t size() const { return nodes_.size(); }
+
+        // Longest weighted path from the node to the end of the graph.
+        std::size_t rank(node_id node) {
+            prepare();
+            return nodes_[node].rank;
+        }
+
+        // Runs the graph and blocks until every node has run.  Rethrows the first
+        // exception a node threw; nodes that had not started by then are skipped.
+        void run(thread_pool& pool) {
+            start(pool);
+            wait();
+        }
+
+        future<void> run(thread_pool& pool, use_future_t) {
+            if(finished_.load(std::memory_order_acquire) == 0) {
+                throw std::logic_error("task_graph: already running");
+            }
+            promise<void> p;
+            p.set_pool(&pool);
+            auto f = p.get_future();
+            // a cycle throws here, before there is a promise left to complete
+            prepare();
+            promise_.emplace(std::move(p));
+            start(pool);
+            return f;
+        }
+
+        // Starts a run without waiting for it.
+        void start(thread_pool& pool) {
+            if(finished_.load(std::memory_order_acquire) == 0) {
+                throw std::logic_error("task_graph: already running");
+            }
+            prepare();
+            pool_ = &pool;
+            error_ = nullptr;
+            failed_.store(false, std::memory_order_relaxed);
+            for(auto & it : nodes_) {
+                it.pending.store(it.dependencies, std::memory_order_relaxed);
+            }
+            remaining_.store(nodes_.size(), std::memory_order_relaxed);
+            finished_.store(0, std::memory_order_release);
+            if(nodes_.empty()) {
+                complete();
+                return;
+            }
+            batch_.clear();
+            for(auto it : roots_) {
+                batch_.push_back(detail::task_ptr::make<detail::graph_node_task>(*this, it));
+            }
+            pool.submit_bulk(batch_.begin(), batch_.end());
+        }
+
+        // Blocks until the current run, if any, has completed.
+        void wait() {
+            for(int i = 0 ; i < 64 && !finished_.load(std::memory_order_acquire) ; i++) {
+                detail::cpu_relax();
+            }
+            while(!finished_.load(std::memory_order_acquire)) {
+                detail::futex_wait(finished_, 0);
+            }
+            if(error_) {
+                auto e = std::move(error_);
+                error_ = nullptr;
+                std::rethrow_exception(e);
+            }
+        }
+
+    private:
+        friend struct detail::graph_node_task;
+        static constexpr node_id none = static_cast<node_id>(-1);
+
+        struct node {
+            template<class F>
+            node(F&& f, std::size_t weight) : work(std::forward<F>(f)), weight(weight), rank(0), dependencies(0), pending(0) {}
+
+            detail::small_function<void()> work;
+            std::vector<node_id> successors; // longest path first once prepared
+            std::size_t weight;
+            std::size_t rank;
+            uint32_t dependencies;
+            std::atomic<uint32_t> pending;
+        };
+
+        // Orders the nodes topologically, computes each node's rank and sorts
+        // roots and successor lists by it.  Throws on a cycle.
+        void prepare() {
+            if(prepared_) {
+                return;
+            }
+            std::vector<node_id> order;
+            order.reserve(nodes_.size());
+            std::vector<uint32_t> indegree(nodes_.size());
+            for(std::size_t i = 0 ; i < nodes_.size() ; i++) {
+                indegree[i] = nodes_[i].dependencies;
+                if(!indegree[i]) {
+                    order.push_back(i);
+                }
+            }
+            for(std::size_t i = 0 ; i < order.size() ; i++) {
+                for(auto s : nodes_[order[i]].successors) {
+                    if(--indegree[s] == 0) {
+                        order.push_back(s);
+                    }
+                }
+            }
+            if(order.size() != nodes_.size()) {
+                throw std::logic_error("task_graph: dependency cycle");
+            }
+            for(auto it = order.rbegin() ; it != order.rend() ; ++it) {
+                auto& n = nodes_[*it];
+                std::size_t longest = 0;
+                for(auto s : n.successors) {
+                    longest = std::max(longest, nodes_[s].rank);
+                }
+                n.rank = n.weight + longest;
+            }
+            auto by_rank = [this](node_id lhs, node_id rhs) { return nodes_[lhs].rank > nodes_[rhs].rank; };
+            roots_.clear();
+            for(std::size_t i = 0 ; i < nodes_.size() ; i++) {
+                std::stable_sort(nodes_[i].successors.begin(), nodes_[i].successors.end(), by_rank);
+                if(!nodes_[i].dependencies) {
+                    roots_.push_back(i);
+                }
+            }
+            std::stable_sort(roots_.begin(), roots_.end(), by_rank);
+            batch_.reserve(roots_.size());
+            prepared_ = true;
+        }
+
+        // Runs id and then, on the same thread, the best successor it made ready.
+        void execute(node_id id) {
+            while(id != none) {
+                auto& n = nodes_[id];
+                if(!failed_.load(std::memory_order_relaxed)) {
+                    try {
+                        n.work();
+                    } catch(...) {
+                        if(!failed_.exchange(true)) {
+                            error_ = std::current_exception();
+                        }
+                    }
+                }
+                node_id next = none;
+                auto& ready = ready_batch();
+                for(auto s : n.successors) {
+                    if(nodes_[s].pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                        if(next == none) {
+                            next = s;
+                        } else {
+                            ready.push_back(detail::task_ptr::make<detail::graph_node_task>(*this, s));
+                        }
+                    }
+                }
+                if(!ready.empty()) {
+                    // the worker's own deque is popped from the back
+                    if(pool_->options().work_stealing) {
+                        std::reverse(ready.begin(), ready.end());
+                    }
+                    pool_->submit_bulk(ready.begin(), ready.end());
+                    ready.clear();
+                }
+                // the graph may be destroyed as soon as the last node is counted
+                if(remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    complete();
+                    return;
+                }
+                id = next;
+            }
+        }
+
+        // Successors made ready by a node besides the one run next, kept per
+        // thread so that dispatching them does not allocate.
+        static std::vector<detail::task_ptr>& ready_batch() {
+            static thread_local std::vector<detail::task_ptr> batch;
+            return batch;
+        }
+
+        // Nothing of the graph is touched once finished_ is set, a waiter may
+        // destroy or restart it right away.
+        void complete() {
+            auto p = std::move(promise_);
+            promise_.reset();
+            std::exception_ptr error;
+            if(p) {
+                error = std::exchange(error_, nullptr);
+            }
+            finished_.store(1, std::memory_order_release);
+            detail::futex_wake(finished_);
+            if(p) {
+                if(error) {
+                    p->set_exception(std::move(error));
+                } else {
+                    p->set_value();
+                }
+            }
+        }
+
+        std::deque<node> nodes_;
+        std::vector<node_id> roots_;
+        std::vector<detail::task_ptr> batch_;
+        thread_pool* pool_ { nullptr };
+        std::optional<promise<void>> promise_;
+        std::exception_ptr error_;
+        std::atomic<std::size_t> remaining_;
+        std::atomic<uint32_t> finished_;
+        std::atomic<bool> failed_;
+        bool prepared_;
+    };
+
+    namespace detail {
+        inline void graph_node_task::run_v() {
+            graph.execute(node);
+        }
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_GRAPH_HPP */
@@ -0,0 +1,391 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_METRICS_HPP
+#define UNPAUSE_ASYNC_METRICS_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+#include <unpause/__unpause/async/task.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <map>
+#include <vector>
+
+// Metrics are only collected when UNPAUSE_ASYNC_METRICS is defined before the
+// first include.  Otherwise every hook below is an empty inline function and
+// the snapshot functions return empty values.
+//
+// The macro also adds task_container::queued_at, so it changes the layout of
+// every task.  All translation units of a program must agree on it: mixing
+// them is an ODR violation that compiles and links without any diagnostic.
+
+namespace unpause { namespace async {
+
+    // Log-bucketed latency distribution in nanoseconds.  Bucket 0 counts zero,
+    // bucket i counts values in [2^(i-1), 2^i) and the last bucket everything above.
+    struct latency_histogram {
+        static constexpr std::size_t bucket_count = 40;
+
+        std::array<uint64_t, bucket_count> buckets {};
+        uint64_t count { 0 };
+        uint64_t sum { 0 };
+        uint64_t max { 0 };
+
+        double mean() const { return count ? double(sum) / double(count) : 0.0; }
+
+        // Upper bound of the bucket holding the p-th percentile, p in [0, 1].
+        uint64_t percentile(double p) const {
+            if(!count) {
+                return 0;
+            }
+            auto rank = static_cast<uint64_t>(p * double(count - 1)) + 1;
+            uint64_t seen = 0;
+            for(std::size_t i = 0 ; i < bucket_count ; i++) {
+                seen += buckets[i];
+                if(seen >= rank) {
+                    return i == 0 ? 0 : std::min(max, (uint64_t(1) << i) - 1);
+                }
+            }
+            return max;
+        }
+
+        latency_histogram& operator+=(const latency_histogram& rhs) {
+            for(std::size_t i = 0 ; i < bucket_count ; i++) {
+                buckets[i] += rhs.buckets[i];
+            }
+            count += rhs.count;
+            sum += rhs.sum;
+            max = std::max(max, rhs.max);
+            return *this;
+        }
+    };
+
+    // Counters of one task_queue, thread_pool or run_loop.
+    struct queue_metrics {
+        std::string name;
+        uint64_t enqueued { 0 };
+        uint64_t started { 0 };
+        uint64_t completed { 0 };
+        std::size_t threads { 0 };          // workers, 1 for a run_loop, 0 for a task_queue
+        std::chrono::nanoseconds uptime { 0 };
+        latency_histogram wait;             // enqueue to start
+        latency_histogram run;              // start to end
+        latency_histogram lateness;         // run_loop: dispatch_time to start
+
+        std::size_t depth() const { return enqueued > started ? static_cast<std::size_t>(enqueued - started) : 0; }
+
+        // Share of the worker time spent running tasks since construction.
+        double utilisation() const {
+            auto capacity = double(uptime.count()) * double(threads);
+            return capacity > 0 ? std::min(1.0, double(run.sum) / capacity) : 0.0;
+        }
+
+        queue_metrics& operator+=(const queue_metrics& rhs) {
+            enqueued += rhs.enqueued;
+            started += rhs.started;
+            completed += rhs.completed;
+            threads += rhs.threads;
+            uptime = std::max(uptime, rhs.uptime);
+            wait += rhs.wait;
+            run += rhs.run;
+            lateness += rhs.lateness;
+            return *this;
+        }
+    };
+
+    namespace detail {
+
+        // The task behind an element of a bulk submission.
+        inline task_container& container_of(task_container& t) { return t; }
+        inline task_container& container_of(task_ptr& t) { return *t; }
+        inline task_container& container_of(std::unique_ptr<task_container>& t) { return *t; }
+
+#if defined(UNPAUSE_ASYNC_METRICS)
+        constexpr bool metrics_enabled = true;
+        using metrics_stamp = std::chrono::steady_clock::time_point;
+        inline metrics_stamp metrics_now() { return std::chrono::steady_clock::now(); }
+
+        inline std::size_t histogram_bucket(uint64_t ns) {
+            if(ns == 0) {
+                return 0;
+            }
+#if defined(__GNUC__)
+            std::size_t bits = 64 - __builtin_clzll(ns);
+#else
+            std::size_t bits = 0;
+            for(auto v = ns ; v ; v >>= 1) {
+                bits++;
+            }
+#endif
+            return std::min(bits, latency_histogram::bucket_count - 1);
+        }
+
+        // Written by (mostly) one thread, so the relaxed RMWs stay in its cache.
+        struct atomic_histogram {
+            void record(uint64_t ns) {
+                buckets[histogram_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+                count.fetch_add(1, std::memory_order_relaxed);
+                sum.fetch_add(ns, std::memory_order_relaxed);
+                auto current = max.load(std::memory_order_relaxed);
+                while(ns > current && !max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {}
+            }
+
+            void read(latency_histogram& out) const {
+                latency_histogram h;
+                for(std::size_t i = 0 ; i < latency_histogram::bucket_count ; i++) {
+                    h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+                }
+                h.count = count.load(std::memory_order_relaxed);
+                h.sum = sum.load(std::memory_order_relaxed);
+                h.max = max.load(std::memory_order_relaxed);
+                out += h;
+            }
+
+            std::array<std::atomic<uint64_t>, latency_histogram::bucket_count> buckets {};
+            std::atomic<uint64_t> count { 0 };
+            std::atomic<uint64_t> sum { 0 };
+            std::atomic<uint64_t> max { 0 };
+        };
+
+        struct alignas(cache_line_size) metrics_shard {
+            std::atomic<uint64_t> enqueued { 0 };
+            std::atomic<uint64_t> started { 0 };
+            std::atomic<uint64_t> completed { 0 };
+            atomic_histogram wait;
+            atomic_histogram run;
+            atomic_histogram lateness;
+        };
+
+        class metrics_source;
+
+        class metrics_registry {
+        public:
+            static metrics_registry& instance() {
+                static metrics_registry registry;
+                return registry;
+            }
+
+            void attach(metrics_source* source) {
+                std::lock_guard<std::mutex> lk(mutex);
+                sources_.push_back(source);
+            }
+
+            void detach(metrics_source* source) {
+                std::lock_guard<std::mutex> lk(mutex);
+                sources_.erase(std::remove(sources_.begin(), sources_.end(), source), sources_.end());
+            }
+
+            std::map<std::string, queue_metrics> snapshot();
+
+            std::mutex mutex; // also guards the names of the sources
+        private:
+            std::vector<metrics_source*> sources_;
+        };
+
+        // Per-object counters, sharded by thread and merged when read.  Shards
+        // are allocated the first time a thread slot records something.
+        class metrics_source {
+        public:
+            static constexpr std::size_t shard_count = 16;
+
+            explicit metrics_source(std::string name, std::size_t threads = 0, bool attached = true)
+            : name_(std::move(name)), threads_(threads), attached_(attached), created_(metrics_now()) {
+                if(attached_) {
+                    metrics_registry::instance().attach(this);
+                }
+            }
+            metrics_source(const metrics_source&) = delete;
+            metrics_source& operator=(const metrics_source&) = delete;
+
+            ~metrics_source() {
+                if(attached_) {
+                    metrics_registry::instance().detach(this);
+                }
+                for(auto & it : shards_) {
+                    delete it.load(std::memory_order_relaxed);
+                }
+            }
+
+            void set_name(const std::string& name) {
+                std::lock_guard<std::mutex> lk(metrics_registry::instance().mutex);
+                name_ = name;
+            }
+
+            void set_threads(std::size_t threads) { threads_.store(threads, std::memory_order_relaxed); }
+
+            bool enabled() const { return attached_; }
+
+            void enqueue(task_container& task) {
+                if(attached_) {
+                    task.queued_at = metrics_now();
+                    shard().enqueued.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            // For a batch already stamped with stamp().
+            void enqueue(std::size_t count) {
+                if(attached_ && count) {
+                    shard().enqueued.fetch_add(count, std::memory_order_relaxed);
+                }
+            }
+
+            void stamp(task_container& task, metrics_stamp now) {
+                if(attached_) {
+                    task.queued_at = now;
+                }
+            }
+
+            metrics_stamp start(const task_container& task) {
+                if(!attached_) {
+                    return metrics_stamp();
+                }
+                auto now = metrics_now();
+                auto& s = shard();
+                s.started.fetch_add(1, std::memory_order_relaxed);
+                if(task.queued_at != metrics_stamp()) {
+                    s.wait.record(elapsed(task.queued_at, now));
+                }
+                return now;
+            }
+
+            // For timers: records how far past dispatch_time the task started
+            // instead of the time since it was queued.
+            metrics_stamp start_timer(const task_container& task) {
+                if(!attached_) {
+                    return metrics_stamp();
+                }
+                auto now = metrics_now();
+                auto& s = shard();
+                s.started.fetch_add(1, std::memory_order_relaxed);
+                s.lateness.record(elapsed(task.dispatch_time, now));
+                return now;
+            }
+
+            void finish(metrics_stamp started) {
+                if(attached_) {
+                    auto& s = shard();
+                    s.completed.fetch_add(1, std::memory_order_relaxed);
+                    s.run.record(elapsed(started, metrics_now()));
+                }
+            }
+
+            queue_metrics snapshot() const {
+                queue_metrics res;
+                res.threads = threads_.load(std::memory_order_relaxed);
+                res.uptime = std::chrono::duration_cast<std::chrono::nanoseconds>(metrics_now() - created_);
+                for(auto & it : shards_) {
+                    auto s = it.load(std::memory_order_acquire);
+                    if(s) {
+                        res.enqueued += s->enqueued.load(std::memory_order_relaxed);
+                        res.started += s->started.load(std::memory_order_relaxed);
+                        res.completed += s->completed.load(std::memory_order_relaxed);
+                        s->wait.read(res.wait);
+                        s->run.read(res.run);
+                        s->lateness.read(res.lateness);
+                    }
+                }
+                return res;
+            }
+
+            // Caller holds metrics_registry::mutex.
+            const std::string& name_locked() const { return name_; }
+
+            std::string name() const {
+                std::lock_guard<std::mutex> lk(metrics_registry::instance().mutex);
+                return name_;
+            }
+
+        private:
+            static uint64_t elapsed(metrics_stamp from, metrics_stamp to) {
+                return to > from ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count()) : 0;
+            }
+
+            static std::size_t thread_slot() {
+                static std::atomic<std::size_t> next { 0 };
+                static thread_local std::size_t slot = next.fetch_add(1, std::memory_order_relaxed) % shard_count;
+                return slot;
+            }
+
+            metrics_shard& shard() {
+                auto& ref = shards_[thread_slot()];
+                auto s = ref.load(std::memory_order_acquire);
+                if(!s) {
+                    auto fresh = new metrics_shard();
+                    if(ref.compare_exchange_strong(s, fresh, std::memory_order_acq_rel)) {
+                        s = fresh;
+                    } else {
+                        delete fresh;
+                    }
+                }
+                return *s;
+            }
+
+            std::string name_;
+            std::atomic<std::size_t> threads_;
+            const bool attached_;
+            const metrics_stamp created_;
+            std::array<std::atomic<metrics_shard*>, shard_count> shards_ {};
+        };
+
+        inline std::map<std::string, queue_metrics> metrics_registry::snapshot() {
+            std::map<std::string, queue_metrics> res;
+            std::lock_guard<std::mutex> lk(mutex);
+            for(auto source : sources_) {
+                auto& entry = res[source->name_locked()];
+                entry.name = source->name_locked();
+                entry += source->snapshot();
+            }
+            return res;
+        }
+#else
+        constexpr bool metrics_enabled = false;
+        struct metrics_stamp {};
+        inline metrics_stamp metrics_now() { return metrics_stamp(); }
+
+        class metrics_source {
+        public:
+            template<class... A>
+            explicit metrics_source(A&&...) {}
+
+            void set_name(const std::string&) {}
+            void set_threads(std::size_t) {}
+            bool enabled() const { return false; }
+            void enqueue(task_container&) {}
+            void enqueue(std::size_t) {}
+            void stamp(task_container&, metrics_stamp) {}
+            metrics_stamp start(const task_container&) { return metrics_stamp(); }
+            metrics_stamp start_timer(const task_container&) { return metrics_stamp(); }
+            void finish(metrics_stamp) {}
+            queue_metrics snapshot() const { return queue_metrics(); }
+            std::string name() const { return std::string(); }
+        };
+#endif
+    }
+
+    // Counters of every live task_queue, thread_pool and run_loop, merged by
+    // name.  Empty unless UNPAUSE_ASYNC_METRICS is defined.
+    inline std::map<std::string, queue_metrics> metrics_snapshot() {
+#if defined(UNPAUSE_ASYNC_METRICS)
+        return detail::metrics_registry::instance().snapshot();
+#else
+        return std::map<std::string, queue_metrics>();
+#endif
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_METRICS_HPP */
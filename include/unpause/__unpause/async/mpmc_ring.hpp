@@ -0,0 +1,130 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_MPMC_RING_HPP
+#define UNPAUSE_ASYNC_MPMC_RING_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <atomic>
+#include <memory>
+#include <new>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Bounded multi-producer multi-consumer queue (D. Vyukov).  Every cell
+        // carries a sequence number that tells producers and consumers whose
+        // turn it is, so a push or pop is one CAS on the head or tail index and
+        // no locks.  Head and tail sit on separate cache lines.
+        template<class T>
+        class mpmc_ring {
+        public:
+            mpmc_ring(std::size_t capacity) : mask_(round_up(capacity) - 1), cells_(new cell[mask_ + 1]), tail_(0), head_(0) {
+                for(std::size_t i = 0 ; i <= mask_ ; i++) {
+                    cells_[i].sequence.store(i, std::memory_order_relaxed);
+                }
+            };
+            mpmc_ring(const mpmc_ring& other) = delete;
+            mpmc_ring& operator=(const mpmc_ring& other) = delete;
+
+            ~mpmc_ring() {
+                T value;
+                while(try_pop(value)) {}
+            }
+
+            // Leaves value untouched and returns false when the ring is full.
+            bool try_push(T& value) {
+                cell* c = nullptr;
+                std::size_t pos = tail_.load(std::memory_order_relaxed);
+                for(;;) {
+                    c = &cells_[pos & mask_];
+                    std::size_t seq = c->sequence.load(std::memory_order_acquire);
+                    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                    if(diff == 0) {
+                        if(tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            break;
+                        }
+                    } else if(diff < 0) {
+                        return false;
+                    } else {
+                        pos = tail_.load(std::memory_order_relaxed);
+                    }
+                }
+                ::new (c->storage()) T(std::move(value));
+                c->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            bool try_pop(T& value) {
+                cell* c = nullptr;
+                std::size_t pos = head_.load(std::memory_order_relaxed);
+                for(;;) {
+                    c = &cells_[pos & mask_];
+                    std::size_t seq = c->sequence.load(std::memory_order_acquire);
+                    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                    if(diff == 0) {
+                        if(head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            break;
+                        }
+                    } else if(diff < 0) {
+                        return false;
+                    } else {
+                        pos = head_.load(std::memory_order_relaxed);
+                    }
+                }
+                T* item = c->item();
+                value = std::move(*item);
+                item->~T();
+                c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Approximate while producers or consumers are active.
+            std::size_t size() const {
+                auto head = head_.load(std::memory_order_acquire);
+                auto tail = tail_.load(std::memory_order_acquire);
+                return tail > head ? tail - head : 0;
+            }
+
+            bool empty() const { return size() == 0; }
+            std::size_t capacity() const { return mask_ + 1; }
+
+        private:
+            struct cell {
+                std::atomic<std::size_t> sequence;
+                alignas(T) unsigned char data[sizeof(T)];
+
+                void* storage() { return data; }
+                T* item() { return std::launder(reinterpret_cast<T*>(data)); }
+            };
+
+            static std::size_t round_up(std::size_t v) {
+                std::size_t r = 2;
+                while(r < v) {
+                    r <<= 1;
+                }
+                return r;
+            }
+
+            const std::size_t mask_;
+            std::unique_ptr<cell[]> cells_;
+            alignas(cache_line_size) std::atomic<std::size_t> tail_;
+            alignas(cache_line_size) std::atomic<std::size_t> head_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_MPMC_RING_HPP */
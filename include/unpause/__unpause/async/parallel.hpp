@@ -0,0 +1,218 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_PARALLEL_HPP
+#define UNPAUSE_ASYNC_PARALLEL_HPP
+
+#include <unpause/__unpause/async/futex.hpp>
+
+#include <type_traits>
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <cstddef>
+#include <utility>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        template<class T>
+        struct alignas(cache_line_size) padded {
+            T value;
+        };
+
+        // Shared between the caller and the helper tasks of one parallel call.
+        // Chunks are claimed with guided self-scheduling: each claim takes a share
+        // of what is left (never less than the grain), so early chunks are large
+        // and the tail is split finely enough to even out uneven work.
+        struct parallel_state {
+            parallel_state(std::size_t count, std::size_t grain, std::size_t participants)
+            : count(count), grain(grain), participants(participants), next(0), done(0), finished(0), ids(1), failed(false) {};
+
+            bool claim(std::size_t& begin, std::size_t& end) {
+                std::size_t current = next.load(std::memory_order_relaxed);
+                for(;;) {
+                    if(current >= count) {
+                        return false;
+                    }
+                    std::size_t remaining = count - current;
+                    std::size_t chunk = std::min(remaining, std::max(grain, remaining / (2 * participants)));
+                    if(next.compare_exchange_weak(current, current + chunk, std::memory_order_relaxed)) {
+                        begin = current;
+                        end = current + chunk;
+                        return true;
+                    }
+                }
+            }
+
+            void complete(std::size_t n) {
+                if(done.fetch_add(n, std::memory_order_acq_rel) + n == count) {
+                    finished.store(1, std::memory_order_release);
+                    futex_wake(finished);
+                }
+            }
+
+            void fail(std::exception_ptr e) {
+                if(!failed.exchange(true)) {
+                    error = std::move(e);
+                }
+                // stop handing out chunks, the skipped elements still count as done
+                auto skipped = next.exchange(count);
+                if(skipped < count) {
+                    complete(count - skipped);
+                }
+            }
+
+            void wait() {
+                for(int i = 0 ; i < 256 && !finished.load(std::memory_order_acquire) ; i++) {
+                    cpu_relax();
+                }
+                while(!finished.load(std::memory_order_acquire)) {
+                    futex_wait(finished, 0);
+                }
+            }
+
+            const std::size_t count;
+            const std::size_t grain;
+            const std::size_t participants;
+            alignas(cache_line_size) std::atomic<std::size_t> next;
+            alignas(cache_line_size) std::atomic<std::size_t> done;
+            std::atomic<uint32_t> finished;
+            std::atomic<std::size_t> ids;
+            std::atomic<bool> failed;
+            std::exception_ptr error;
+        };
+
+        template<class Body>
+        void parallel_work(parallel_state& state, Body& body, std::size_t participant) {
+            std::size_t begin = 0;
+            std::size_t end = 0;
+            while(state.claim(begin, end)) {
+                try {
+                    body(begin, end, participant);
+                } catch(...) {
+                    state.fail(std::current_exception());
+                }
+                state.complete(end - begin);
+            }
+        }
+
+        // Calls body(begin, end, participant) over [0, count) using the calling
+        // thread plus up to one helper task per pool worker.  participant is in
+        // [0, participants) and unique to the thread running the chunk, so it can
+        // index per-participant accumulators without sharing.  Returns once every
+        // chunk has run.
+        template<class Body>
+        void parallel_run(thread_pool& pool, std::size_t count, std::size_t grain, std::size_t participants, Body& body) {
+            if(count == 0) {
+                return;
+            }
+            auto state = std::make_shared<parallel_state>(count, std::max<std::size_t>(grain, 1), participants);
+            std::size_t helpers = std::min(participants - 1, (count + state->grain - 1) / state->grain - 1);
+            if(helpers > 0) {
+                std::vector<task_ptr> batch;
+                batch.reserve(helpers);
+                Body* b = &body;
+                for(std::size_t i = 0 ; i < helpers ; i++) {
+                    batch.push_back(make_task_ptr(make_task([state, b] {
+                        auto id = state->ids.fetch_add(1, std::memory_order_relaxed);
+                        parallel_work(*state, *b, id);
+                    })));
+                }
+                pool.submit_bulk(batch.begin(), batch.end());
+            }
+            parallel_work(*state, body, 0);
+            state->wait();
+            if(state->error) {
+                std::rethrow_exception(state->error);
+            }
+        }
+
+        inline std::size_t parallel_participants(thread_pool& pool) {
+            auto worker = current_worker();
+            // a worker calling in takes the place of one helper
+            return pool.thread_count() + ((worker && worker->pool == &pool) ? 0 : 1);
+        }
+
+        inline std::size_t default_grain(std::size_t count, std::size_t participants) {
+            return std::max<std::size_t>(1, count / (participants * 8));
+        }
+    }
+
+    // Calls f(i) for every i in [first, last).  grain is the smallest number of
+    // indices handed out at once, 0 picks one from the range size.
+    template<class Index, class F>
+    void parallel_for(thread_pool& pool, Index first, Index last, F&& f, std::size_t grain = 0) {
+        static_assert(std::is_integral<Index>::value, "parallel_for expects an integral index range");
+        if(last <= first) {
+            return;
+        }
+        auto count = static_cast<std::size_t>(last - first);
+        auto participants = detail::parallel_participants(pool);
+        auto body = [&](std::size_t begin, std::size_t end, std::size_t) {
+            for(std::size_t i = begin ; i < end ; i++) {
+                f(static_cast<Index>(first + i));
+            }
+        };
+        detail::parallel_run(pool, count, grain ? grain : detail::default_grain(count, participants), participants, body);
+    }
+
+    // out[i] = op(in[i]) over random access ranges.
+    template<class InputIt, class OutputIt, class F>
+    OutputIt parallel_transform(thread_pool& pool, InputIt first, InputIt last, OutputIt out, F&& op, std::size_t grain = 0) {
+        auto count = static_cast<std::size_t>(std::distance(first, last));
+        auto participants = detail::parallel_participants(pool);
+        auto body = [&](std::size_t begin, std::size_t end, std::size_t) {
+            auto in = first + begin;
+            auto o = out + begin;
+            for(std::size_t i = begin ; i < end ; i++, ++in, ++o) {
+                *o = op(*in);
+            }
+        };
+        detail::parallel_run(pool, count, grain ? grain : detail::default_grain(count, participants), participants, body);
+        return out + count;
+    }
+
+    // Folds map(i) for i in [first, last) with reduce, starting from identity.
+    // Every participant accumulates into its own cache-line sized slot and the
+    // slots are combined on the calling thread, so reduce must be associative
+    // and commutative.
+    template<class Index, class T, class Map, class Reduce>
+    T parallel_reduce(thread_pool& pool, Index first, Index last, T identity, Map&& map, Reduce&& reduce, std::size_t grain = 0) {
+        static_assert(std::is_integral<Index>::value, "parallel_reduce expects an integral index range");
+        if(last <= first) {
+            return identity;
+        }
+        auto count = static_cast<std::size_t>(last - first);
+        auto participants = detail::parallel_participants(pool);
+        std::vector<detail::padded<T>> partials(participants, detail::padded<T> { identity });
+        auto body = [&](std::size_t begin, std::size_t end, std::size_t participant) {
+            T acc = identity;
+            for(std::size_t i = begin ; i < end ; i++) {
+                acc = reduce(std::move(acc), map(static_cast<Index>(first + i)));
+            }
+            auto& slot = partials[participant].value;
+            slot = reduce(std::move(slot), std::move(acc));
+        };
+        detail::parallel_run(pool, count, grain ? grain : detail::default_grain(count, participants), participants, body);
+        T result = std::move(identity);
+        for(auto & it : partials) {
+            result = reduce(std::move(result), std::move(it.value));
+        }
+        return result;
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_PARALLEL_HPP */
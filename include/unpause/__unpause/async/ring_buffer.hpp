@@ -0,0 +1,114 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_RING_BUFFER_HPP
+#define UNPAUSE_ASYNC_RING_BUFFER_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Growable circular buffer that stores its elements by value in one
+        // contiguous allocation.  Not thread safe, callers provide the locking.
+        template<class T>
+        class ring_buffer {
+        public:
+            ring_buffer(std::size_t capacity = 16) : slots_(round_up(capacity)), head_(0), tail_(0) {};
+            ring_buffer(const ring_buffer& other) = delete;
+            ring_buffer& operator=(const ring_buffer& other) = delete;
+
+            void push_back(T&& value) {
+                if(size() == slots_.size()) {
+                    grow(slots_.size() * 2);
+                }
+                slots_[tail_ & mask()] = std::move(value);
+                ++tail_;
+            }
+
+            T pop_front() {
+                T value = std::move(slots_[head_ & mask()]);
+                ++head_;
+                return value;
+            }
+
+            T pop_back() {
+                --tail_;
+                return std::move(slots_[tail_ & mask()]);
+            }
+
+            T& front() { return slots_[head_ & mask()]; }
+            T& back() { return slots_[(tail_ - 1) & mask()]; }
+            T& operator[](std::size_t i) { return slots_[(head_ + i) & mask()]; }
+
+            std::size_t size() const { return tail_ - head_; }
+            bool empty() const { return tail_ == head_; }
+
+            void reserve(std::size_t capacity) {
+                if(capacity > slots_.size()) {
+                    grow(round_up(capacity));
+                }
+            }
+
+            void clear() {
+                while(!empty()) {
+                    pop_front();
+                }
+                head_ = tail_ = 0;
+            }
+
+            // Rotates the contents so they start at slot 0 and returns the first
+            // element, [begin, begin + size()) is then a contiguous range.
+            T* linearize() {
+                if((head_ & mask()) + size() > slots_.size()) {
+                    grow(slots_.size());
+                } else if(!empty()) {
+                    auto offset = head_ & mask();
+                    head_ = offset;
+                    tail_ = offset + size();
+                    return slots_.data() + offset;
+                }
+                return slots_.data() + (head_ & mask());
+            }
+
+        private:
+            static std::size_t round_up(std::size_t v) {
+                std::size_t r = 1;
+                while(r < v) {
+                    r <<= 1;
+                }
+                return r;
+            }
+
+            std::size_t mask() const { return slots_.size() - 1; }
+
+            void grow(std::size_t capacity) {
+                std::vector<T> next(capacity);
+                std::size_t n = size();
+                for(std::size_t i = 0 ; i < n ; i++) {
+                    next[i] = std::move(slots_[(head_ + i) & mask()]);
+                }
+                slots_.swap(next);
+                head_ = 0;
+                tail_ = n;
+            }
+
+            std::vector<T> slots_;
+            std::size_t head_;
+            std::size_t tail_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_RING_BUFFER_HPP */
@@ -11,6 +11,11 @@
 #ifndef UNPAUSE_ASYNC_RUN_HPP
 #define UNPAUSE_ASYNC_RUN_HPP
 
+#include <type_traits>
+#include <iterator>
+#include <memory>
+#include <vector>
+
 
 namespace unpause { namespace async {
     
@@ -30,55 +35,142 @@ namespace unpause { namespace async {
     
     // run(thread_pool...)
     namespace detail {
-        inline void run(thread_pool& pool, std::unique_ptr<detail::task_container>&& task) {
-            pool.tasks.add(std::move(task));
-            pool.task_waiter.notify_one();
+        inline void run(thread_pool& pool, detail::task_ptr&& task) {
+            pool.submit(std::move(task));
         }
     }
     
     template<class R, class... Args>
     void run(thread_pool& pool, task<R, Args...>& t) {
-        std::lock_guard<std::mutex> guard(pool.task_mutex);
-        pool.tasks.add(t);
-        pool.task_waiter.notify_one();
+        pool.submit(detail::task_ptr::make<task<R, Args...>>(std::move(t)));
+    }
+
+    template<class R, class After, class... Args>
+    void run(thread_pool& pool, static_task<R, After, Args...>& t) {
+        pool.submit(detail::task_ptr::make<static_task<R, After, Args...>>(std::move(t)));
     }
     
     template<class R, class... Args>
     void run(thread_pool& pool, R&& r, Args&&... a) {
-        std::lock_guard<std::mutex> guard(pool.task_mutex);
-        pool.tasks.add(std::forward<R>(r), std::forward<Args>(a)...);
-        pool.task_waiter.notify_one();
+        pool.submit(detail::task_ptr::make<task<R, Args...>>(std::forward<R>(r), std::forward<Args>(a)...));
+    }
+
+    // run(thread_pool, priority...)
+    template<class R, class... Args>
+    void run(thread_pool& pool, priority p, task<R, Args...>& t) {
+        pool.submit(p, detail::task_ptr::make<task<R, Args...>>(std::move(t)));
+    }
+
+    template<class R, class... Args>
+    void run(thread_pool& pool, priority p, R&& r, Args&&... a) {
+        pool.submit(p, detail::task_ptr::make<task<R, Args...>>(std::forward<R>(r), std::forward<Args>(a)...));
     }
     
+    // run_before(thread_pool, deadline...)
+    // Runs the task on the pool ahead of tasks without a deadline, earliest
+    // deadline first (see thread_pool::submit(deadline, ...)).
+    template<class R, class... Args>
+    void run_before(thread_pool& pool, std::chrono::steady_clock::time_point deadline, task<R, Args...>& t) {
+        pool.submit(deadline, detail::task_ptr::make<task<R, Args...>>(std::move(t)));
+    }
+
+    template<class R, class After, class... Args>
+    void run_before(thread_pool& pool, std::chrono::steady_clock::time_point deadline, static_task<R, After, Args...>& t) {
+        pool.submit(deadline, detail::task_ptr::make<static_task<R, After, Args...>>(std::move(t)));
+    }
+
+    template<class R, class... Args>
+    void run_before(thread_pool& pool, std::chrono::steady_clock::time_point deadline, R&& r, Args&&... a) {
+        pool.submit(deadline, detail::task_ptr::make<task<R, Args...>>(std::forward<R>(r), std::forward<Args>(a)...));
+    }
+
+    // run_bulk(thread_pool...)
+    // Runs fn(element) for every element of [first, last), queued as one batch.
+    template<class It, class F>
+    void run_bulk(thread_pool& pool, It first, It last, F&& fn) {
+        using value_type = typename std::iterator_traits<It>::value_type;
+        using func_type = std::decay_t<F>;
+        std::vector<detail::task_ptr> batch;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value) {
+            batch.reserve(std::distance(first, last));
+        }
+        for(; first != last ; ++first) {
+            batch.push_back(detail::task_ptr::make<task<func_type, value_type>>(func_type(fn), value_type(*first)));
+        }
+        pool.submit_bulk(batch.begin(), batch.end());
+    }
+
+    template<class R, class... Args>
+    void run_bulk(thread_pool& pool, std::vector<task<R, Args...>>& tasks) {
+        pool.submit_bulk(tasks.begin(), tasks.end());
+    }
+
     // run(thread_pool, task_queue...)
+    namespace detail {
+        // Pool task that runs a batch of a serial queue's tasks.
+        struct strand_drain : public task_container {
+            strand_drain(thread_pool& pool, std::shared_ptr<strand> s) : pool(pool), s(std::move(s)) {};
+
+            virtual void run_v() {
+                s->drain([this] {
+                    pool.submit(task_ptr::make<strand_drain>(pool, s));
+                });
+            }
+
+            thread_pool& pool;
+            std::shared_ptr<strand> s;
+        };
+    }
+
+    namespace detail {
+        // Queues t on a serial queue's strand without touching the queue itself,
+        // so callers holding only the strand and token can outlive the queue.
+        template<class Task>
+        void run_strand(thread_pool& pool, const std::shared_ptr<strand>& s, const cancel_token& token, Task& t)
+        {
+            auto task = task_ptr::make<Task>(std::move(t));
+            if(!task->token.valid()) {
+                task->token = token;
+            }
+            s->metrics.enqueue(*task);
+            if(s->push(std::move(task))) {
+                pool.submit(task_ptr::make<strand_drain>(pool, s));
+            }
+        }
+
+        // Same without a pool: when the strand was idle the calling thread
+        // becomes its owner and runs it until it is empty.
+        template<class Task>
+        void run_strand(const std::shared_ptr<strand>& s, const cancel_token& token, Task& t)
+        {
+            auto task = task_ptr::make<Task>(std::move(t));
+            if(!task->token.valid()) {
+                task->token = token;
+            }
+            s->metrics.enqueue(*task);
+            if(s->push(std::move(task))) {
+                bool more = true;
+                while(more) {
+                    more = false;
+                    s->drain([&more] { more = true; });
+                }
+            }
+        }
+    }
+
     template<class R, class... Args>
     void run(thread_pool& pool, task_queue& queue, task<R, Args...>& t)
     {
-        std::weak_ptr<std::atomic<bool>> token = queue.token;
-        if(!token.expired() && !queue.complete.load()) {
-            auto after = std::move(t.after_internal);
-            auto try_next = [&, token] {
-                if(!token.expired() && queue.has_next() && queue.task_mutex.try_lock()) {
-                    auto next = queue.next_pop();
-                    if(next) {
-                        queue.inc_lock(); // add in-flight
-                        detail::run(pool, std::move(next));
-                    } else {
-                        queue.task_mutex.unlock();
-                    }
-                } 
-            };
-
-            t.after_internal = [&, after = std::move(after), try_next] {
-                if(after) {
-                    after();
-                }
-                queue.task_mutex.unlock();
-                try_next();
-                queue.dec_lock();
-            };
-            queue.add(t);
-            try_next();
+        if(!queue.complete.load()) {
+            detail::run_strand(pool, queue.strand(), queue.cancellation.token(), t);
+        }
+    }
+
+    template<class R, class After, class... Args>
+    void run(thread_pool& pool, task_queue& queue, static_task<R, After, Args...>& t)
+    {
+        if(!queue.complete.load()) {
+            detail::run_strand(pool, queue.strand(), queue.cancellation.token(), t);
         }
     }
     template<class R, class... Args>
@@ -90,25 +182,44 @@ namespace unpause { namespace async {
     }
     
     // run_sync
-    template<class R, class... Args>
-    void run_sync(thread_pool& pool, task<R, Args...>& t) {
-        std::mutex m;
-        std::condition_variable v;
-        std::atomic<bool> d(false);
-        std::function<void()> after = std::move(t.after_internal);
-        
-        t.after_internal = [&, after = std::move(after)] {
-            if(after) {
-                after();
+    namespace detail {
+        // Wakes the thread waiting in run_sync once the task is done.
+        struct sync_hook : public task_hook {
+            sync_hook() {
+                after = [](task_hook& hook) { static_cast<sync_hook&>(hook).signal(); };
+            }
+
+            void signal() {
+                std::lock_guard<std::mutex> lk(m);
+                done = true;
+                v.notify_one();
+            }
+
+            void wait() {
+                std::unique_lock<std::mutex> lk(m);
+                v.wait(lk, [this] { return done; });
             }
-            std::lock_guard<std::mutex> guard(m);
-            d = true;
-            v.notify_one();
+
+            std::mutex m;
+            std::condition_variable v;
+            bool done { false };
         };
-        
+    }
+
+    template<class R, class... Args>
+    void run_sync(thread_pool& pool, task<R, Args...>& t) {
+        detail::sync_hook hook;
+        t.link(hook);
+        run(pool, t);
+        hook.wait();
+    }
+
+    template<class R, class After, class... Args>
+    void run_sync(thread_pool& pool, static_task<R, After, Args...>& t) {
+        detail::sync_hook hook;
+        t.link(hook);
         run(pool, t);
-        std::unique_lock<std::mutex> lk(m);
-        v.wait(lk, [&] { return d.load(); });
+        hook.wait();
     }
     
     template<class R, class... Args>
@@ -121,23 +232,21 @@ namespace unpause { namespace async {
     void run_sync(thread_pool& pool, task_queue& queue, task<R, Args...>& t)
     {
         if(!queue.complete.load()) {
-            std::mutex m;
-            std::condition_variable v;
-            std::atomic<bool> d(false);
-            auto after = std::move(t.after_internal);
+            detail::sync_hook hook;
+            t.link(hook);
+            run(pool, queue, t);
+            hook.wait();
+        }
+    }
 
-            t.after_internal = [&, after = std::move(after)] {
-                if(after) {
-                    after();
-                }
-                std::lock_guard<std::mutex> guard(m);
-                d = true;
-                v.notify_one();
-            };
-            
+    template<class R, class After, class... Args>
+    void run_sync(thread_pool& pool, task_queue& queue, static_task<R, After, Args...>& t)
+    {
+        if(!queue.complete.load()) {
+            detail::sync_hook hook;
+            t.link(hook);
             run(pool, queue, t);
-            std::unique_lock<std::mutex> lk(m);
-            v.wait(lk, [&] { return d.load(); });
+            hook.wait();
         }
     }
     
@@ -160,8 +269,7 @@ namespace unpause { namespace async {
         if(!pool.runloop) {
             pool.runloop.emplace();
         }
-        pool.runloop->queue.add(w);
-        pool.runloop->notify();
+        pool.runloop->add(w);
     }
     
     template<class R, class... Args>
@@ -171,18 +279,18 @@ namespace unpause { namespace async {
     
     template<class R, class... Args>
     void schedule(thread_pool& pool, task_queue& queue, std::chrono::steady_clock::time_point point, task<R, Args...>&& t) {
-        std::weak_ptr<std::atomic<bool>> token = queue.token;
-        auto w = make_task([token] (thread_pool& pool, task_queue& queue, task<R, Args...>&& t){
-            if(!token.expired()) {
-                run(pool, queue, t);
+        // the queue may be gone by the deadline, the strand is kept alive instead
+        auto token = queue.cancellation.token();
+        auto w = make_task([token, s = queue.strand()] (thread_pool& pool, task<R, Args...>&& t){
+            if(!token.cancelled()) {
+                detail::run_strand(pool, s, token, t);
             }
-        }, pool, queue, std::move(t));
+        }, pool, std::move(t));
         w.dispatch_time = point;
         if(!pool.runloop) {
             pool.runloop.emplace();
         }
-        pool.runloop->queue.add(w);
-        pool.runloop->notify();
+        pool.runloop->add(w);
     }
     template<class R, class... Args>
     void schedule(thread_pool& pool, task_queue& queue, std::chrono::steady_clock::time_point point, R&& r, Args&&... a) {
@@ -191,15 +299,12 @@ namespace unpause { namespace async {
     
     template<class R, class... Args>
     void schedule(run_loop& loop, task_queue& queue, std::chrono::steady_clock::time_point point, task<R, Args...>&& t) {
-        std::weak_ptr<std::atomic<bool>> token = queue.token;
-        auto w = make_task([token] (thread_pool&, task_queue& queue, task<R, Args...>&& t){
-            if(!token.expired()) {
-                run(queue, t);
-            }
+        auto w = make_task([] (task_queue& queue, task<R, Args...>&& t){
+            run(queue, t);
         }, queue, std::move(t));
+        w.token = queue.cancellation.token();
         w.dispatch_time = point;
-        loop.queue.add(w);
-        loop.notify();
+        loop.add(w);
     }
     
     template<class R, class... Args>
@@ -210,14 +315,87 @@ namespace unpause { namespace async {
     template<class R, class... Args>
     void schedule(run_loop& loop, std::chrono::steady_clock::time_point point, task<R, Args...>&& t) {
         t.dispatch_time = point;
-        loop.queue.add(t);
-        loop.notify();
+        loop.add(t);
     }
     
     template<class R, class... Args>
     void schedule(run_loop& loop, std::chrono::steady_clock::time_point point, R&& r, Args&&... a) {
         schedule(loop, point, make_task(std::forward<R>(r), std::forward<Args>(a)...));
     }
+
+    // schedule_every
+
+    template<class F>
+    void schedule_every(run_loop& loop, std::chrono::steady_clock::duration period, F&& f, const periodic_options& options = periodic_options()) {
+        loop.every(period, std::forward<F>(f), options);
+    }
+
+    // Beats are timed by the pool's runloop and run on the pool, so a slow
+    // callback can overlap the next beat; fixed_delay counts from when the
+    // previous beat was handed to the pool.
+    template<class F>
+    void schedule_every(thread_pool& pool, std::chrono::steady_clock::duration period, F&& f, const periodic_options& options = periodic_options()) {
+        auto fn = std::make_shared<std::decay_t<F>>(std::forward<F>(f));
+        if(!pool.runloop) {
+            pool.runloop.emplace();
+        }
+        pool.runloop->every(period, [&pool, fn] {
+            run(pool, [fn] { (*fn)(); });
+        }, options);
+    }
+
+    // watch
+
+    // Runs f(events) on the pool each time fd becomes ready (see
+    // run_loop::watch).  The fd is not reported again until f has returned,
+    // so at most one f per fd runs at a time.  An fd that cannot be re-armed
+    // afterwards, e.g. closed before unwatch(), is silently dropped.
+    template<class F>
+    void watch(run_loop& loop, int fd, uint32_t interest, thread_pool& pool, F&& f) {
+        auto fn = std::make_shared<std::decay_t<F>>(std::forward<F>(f));
+        loop.watch(fd, interest, [&loop, &pool, fd, fn] (uint32_t events) {
+            run(pool, [&loop, fd, fn, events] {
+                (*fn)(events);
+                loop.rearm(fd);
+            });
+        }, true);
+    }
+
+    // Same, with f run in the serial queue.  Once the queue is gone the fd
+    // stays disarmed until unwatched.
+    template<class F>
+    void watch(run_loop& loop, int fd, uint32_t interest, thread_pool& pool, task_queue& queue, F&& f) {
+        auto fn = std::make_shared<std::decay_t<F>>(std::forward<F>(f));
+        auto token = queue.cancellation.token();
+        loop.watch(fd, interest, [&loop, &pool, fd, fn, token, s = queue.strand()] (uint32_t events) {
+            if(token.cancelled()) {
+                return;
+            }
+            auto t = make_task([&loop, fd, fn, events] {
+                (*fn)(events);
+                loop.rearm(fd);
+            });
+            detail::run_strand(pool, s, token, t);
+        }, true);
+    }
+
+    // Same, with f run in the serial queue on the looper thread, unless a
+    // worker is running the queue at that moment.
+    template<class F>
+    void watch(run_loop& loop, int fd, uint32_t interest, task_queue& queue, F&& f) {
+        auto fn = std::make_shared<std::decay_t<F>>(std::forward<F>(f));
+        auto token = queue.cancellation.token();
+        loop.watch(fd, interest, [&loop, fd, fn, token, s = queue.strand()] (uint32_t events) {
+            if(token.cancelled()) {
+                return;
+            }
+            auto t = make_task([&loop, fd, fn, events] {
+                (*fn)(events);
+                loop.rearm(fd);
+            });
+            detail::run_strand(s, token, t);
+        }, true);
+    }
 }
 }
 #endif /* UNPAUSE_ASYNC_RUN_HPP */
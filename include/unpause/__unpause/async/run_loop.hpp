@@ -11,71 +11,489 @@
 #ifndef UNPAUSE_ASYNC_RUN_LOOP_HPP
 #define UNPAUSE_ASYNC_RUN_LOOP_HPP
 
+#include <unpause/__unpause/async/metrics.hpp>
+
 #include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <system_error>
+#include <stdexcept>
+#include <cstdint>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <vector>
+#include <string>
 #include <atomic>
+#include <cerrno>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
 
 namespace unpause { namespace async {
 
+    // Readiness passed to watch() and reported to its callbacks.  io_error
+    // (error or hang-up) is always reported, it cannot be asked for.
+    constexpr uint32_t io_read = 1;
+    constexpr uint32_t io_write = 2;
+    constexpr uint32_t io_error = 4;
+
+    enum class timer_mode {
+        fixed_rate,     // beats at first + k * period, skipping the ones missed while late
+        fixed_delay     // each beat period after the previous callback returned
+    };
+
+    struct periodic_options {
+        timer_mode mode { timer_mode::fixed_rate };
+
+        // How much later than its beat the timer may fire.  Deadlines are
+        // rounded up to a grid no coarser than slack, so timers with similar
+        // slack share looper wake-ups; the beats themselves do not drift.
+        std::chrono::steady_clock::duration slack { 0 };
+
+        // First beat; defaults to one period from now.
+        std::chrono::steady_clock::time_point first;
+
+        // The timer stops once the token is cancelled.
+        cancel_token token;
+    };
+
+    namespace detail {
+        // A periodic timer between beats.  dispatch_time is when the looper
+        // fires it, next the beat that stands for.
+        struct periodic_timer : public task_container {
+            template<class F>
+            explicit periodic_timer(F&& f) : callback(std::forward<F>(f)) {}
+            virtual void run_v() { callback(); }
+
+            small_function<void()> callback;
+            std::chrono::steady_clock::duration period;
+            std::chrono::steady_clock::duration slack;
+            std::chrono::steady_clock::time_point next;
+            timer_mode mode { timer_mode::fixed_rate };
+        };
+    }
+
+    struct run_loop_options {
+        // Host an epoll reactor (Linux only): the looper waits for timers and
+        // watched file descriptors in one epoll_wait, timers through a timerfd.
+        bool io { false };
+    };
+
     class run_loop {
 
     public:
-        run_loop() : exiting_(false), dirty_(false), looper_(&run_loop::loop, this) {};
+        run_loop() : run_loop(run_loop_options()) {};
+        explicit run_loop(const run_loop_options& options) : exiting_(false), dirty_(false), metrics_("run_loop", 1) {
+            if(options.io) {
+                open_reactor();
+            }
+            looper_ = std::thread(&run_loop::loop, this);
+        }
         ~run_loop() {
             mutex_.lock();
             exiting_ = true;
             cond_.notify_all();
+            wake_reactor();
             mutex_.unlock();
             if(looper_.joinable()) {
                 looper_.join();
             }
+            close_reactor();
         };
+
+        // Queues a task to run on the looper thread at task->dispatch_time.
+        void add(detail::task_ptr&& task) {
+            if(!task) {
+                return;
+            }
+            std::lock_guard<std::mutex> lk(mutex_);
+            if(exiting_.load()) {
+                return;
+            }
+            auto point = task->dispatch_time;
+            metrics_.enqueue(1);
+            bool earliest = !has_timers() || point < next_deadline();
+            timers_.push(point, std::move(task));
+            if(earliest) {
+                reschedule();
+            }
+        }
+
+        // Runs f on the looper thread every period until options.token is
+        // cancelled.  Beats are kept on the period's grid, a slow callback
+        // delays the next fire but not the ones after it (fixed_rate).
+        template<class F>
+        void every(std::chrono::steady_clock::duration period, F&& f, const periodic_options& options = periodic_options()) {
+            if(period <= std::chrono::steady_clock::duration::zero()) {
+                throw std::invalid_argument("run_loop: period must be positive");
+            }
+            auto timer = std::make_unique<detail::periodic_timer>(std::forward<F>(f));
+            timer->period = period;
+            timer->slack = std::max(options.slack, std::chrono::steady_clock::duration::zero());
+            timer->mode = options.mode;
+            timer->token = options.token;
+            timer->next = options.first == std::chrono::steady_clock::time_point() ? std::chrono::steady_clock::now() + period : options.first;
+            timer->dispatch_time = coalesce(timer->next, timer->slack);
+            std::lock_guard<std::mutex> lk(mutex_);
+            if(exiting_.load()) {
+                return;
+            }
+            auto point = timer->dispatch_time;
+            metrics_.enqueue(1);
+            bool earliest = !has_timers() || point < next_deadline();
+            periodic_.push(point, std::move(timer));
+            if(earliest) {
+                reschedule();
+            }
+        }
+
+        template<class R, class... Args>
+        void add(task<R, Args...>& t) {
+            add(detail::task_ptr::make<task<R, Args...>>(std::move(t)));
+        }
         
+        // Wakes the looper so it re-evaluates its next deadline.
         void notify() {
-            mutex_.lock();
+            std::lock_guard<std::mutex> lk(mutex_);
             if(!exiting_.load()) {
-                queue.sort([](const detail::task_container& lhs, const detail::task_container& rhs) {
-                    return lhs.dispatch_time < rhs.dispatch_time;
-                });
                 dirty_ = true;
                 cond_.notify_all();
+                wake_reactor();
             }
-            mutex_.unlock();
         };
-        
-        task_queue queue;
+
+        bool io() const { return epoll_ >= 0; }
+
+        // Calls callback(events) on the looper thread while fd is ready for
+        // interest (io_read and/or io_write, level triggered).  With oneshot the
+        // fd is disarmed after each event until rearm(fd), which lets another
+        // thread handle the event without the looper reporting it again.  One
+        // watch per fd; requires a loop constructed with io.
+        template<class F>
+        void watch(int fd, uint32_t interest, F&& callback, bool oneshot = false) {
+            auto w = std::make_shared<io_watch>(std::forward<F>(callback));
+            w->interest = interest;
+            w->oneshot = oneshot;
+            std::lock_guard<std::mutex> lk(mutex_);
+            if(!io()) {
+                throw std::logic_error("run_loop: watch needs a loop constructed with io");
+            }
+            if(watches_.count(fd)) {
+                throw std::invalid_argument("run_loop: fd already watched");
+            }
+            w->id = ++watch_ids_;
+            reactor_ctl(true, fd, *w);
+            watches_.emplace(fd, std::move(w));
+        }
+
+        // Re-enables a oneshot watch after its event was handled.  Returns
+        // false when fd is no longer watched, or could not be re-armed (e.g.
+        // closed before unwatch()), in which case the watch is dropped.
+        bool rearm(int fd) noexcept {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto it = watches_.find(fd);
+            if(it == watches_.end()) {
+                return false;
+            }
+            if(!reactor_arm(false, fd, *it->second)) {
+                watches_.erase(it);
+                return false;
+            }
+            return true;
+        }
+
+        // Stops watching fd; call it before closing fd.  A callback that was
+        // already running or handed to another thread may still complete.
+        void unwatch(int fd) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto it = watches_.find(fd);
+            if(it == watches_.end()) {
+                return;
+            }
+            watches_.erase(it);
+#if defined(__linux__)
+            epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+        }
+
+        std::size_t size() {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return timers_.size() + periodic_.size();
+        }
+
+        void set_name(const std::string& name) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            name_ = name;
+            metrics_.set_name(name);
+        }
+        const std::string name() {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return name_;
+        }
+
+        // Timers added and run; lateness is how long after dispatch_time they started.
+        queue_metrics metrics() {
+            auto res = metrics_.snapshot();
+            res.name = name();
+            return res;
+        }
         
     private:
+        struct io_watch {
+            template<class F>
+            explicit io_watch(F&& f) : callback(std::forward<F>(f)) {}
+
+            detail::small_function<void(uint32_t)> callback;
+            uint32_t interest { 0 };
+            uint32_t id { 0 };
+            bool oneshot { false };
+        };
+
+        bool has_timers() const { return !timers_.empty() || !periodic_.empty(); }
+
+        // Earliest deadline of either heap; needs has_timers().
+        std::chrono::steady_clock::time_point next_deadline() const {
+            if(periodic_.empty()) {
+                return timers_.top_deadline();
+            }
+            if(timers_.empty()) {
+                return periodic_.top_deadline();
+            }
+            return std::min(timers_.top_deadline(), periodic_.top_deadline());
+        }
+
+        // Only a new earliest deadline changes how long the looper sleeps.
+        void reschedule() {
+            if(!dirty_.exchange(true)) {
+                wake_reactor();
+            }
+            cond_.notify_one();
+        }
+
+        // Rounds point up to the largest power-of-two grid (in nanoseconds)
+        // that fits in slack.  Coarser grids are subsets of finer ones, so
+        // timers with different slack still meet on common instants.
+        static std::chrono::steady_clock::time_point coalesce(std::chrono::steady_clock::time_point point, std::chrono::steady_clock::duration slack) {
+            auto window = std::chrono::duration_cast<std::chrono::nanoseconds>(slack).count();
+            if(window <= 1) {
+                return point;
+            }
+            int64_t grid = 1;
+            while(grid <= window / 2) {
+                grid <<= 1;
+            }
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(point.time_since_epoch()).count();
+            auto rounded = std::chrono::nanoseconds((ns + grid - 1) / grid * grid);
+            return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(rounded));
+        }
+
+        static void advance(detail::periodic_timer& timer, std::chrono::steady_clock::time_point now) {
+            if(timer.mode == timer_mode::fixed_rate) {
+                timer.next += timer.period;
+                if(timer.next <= now) {
+                    timer.next += ((now - timer.next) / timer.period + 1) * timer.period;
+                }
+            } else {
+                timer.next = now + timer.period;
+            }
+            timer.dispatch_time = coalesce(timer.next, timer.slack);
+        }
+
         void loop() {
+            std::vector<detail::task_ptr> expired;
+            std::vector<std::unique_ptr<detail::periodic_timer>> beats;
+            std::unique_lock<std::mutex> lk(mutex_);
             while(!exiting_.load()) {
-                {
-                    std::unique_lock<std::mutex> lk (mutex_);
-                    auto next_time = queue.next_dispatch_time();
-                    if(next_time == std::chrono::steady_clock::time_point::min()) {
-                        cond_.wait(lk, [this]{ return exiting_.load() || queue.has_next() || dirty_.load(); });
-                    } else if(std::chrono::steady_clock::now() < next_time) {
-                        cond_.wait_until(lk, next_time, [this] {
-                            auto now = std::chrono::steady_clock::now();
-                            return exiting_.load() || queue.next_dispatch_time() <= now || dirty_.load();
-                        });
+                if(io()) {
+                    if(!has_timers() || std::chrono::steady_clock::now() < next_deadline()) {
+                        wait_reactor(lk);
+                        continue;
                     }
+                } else if(!has_timers()) {
+                    cond_.wait(lk, [this]{ return exiting_.load() || dirty_.load(); });
                     dirty_ = false;
+                    continue;
                 }
-
-                while(!exiting_.load() && queue.next_dispatch_time() <= std::chrono::steady_clock::now() &&
-                      queue.next_dispatch_time() != std::chrono::steady_clock::time_point::min()) {
-                    queue.next();
+                auto now = std::chrono::steady_clock::now();
+                auto next_time = next_deadline();
+                if(now < next_time) {
+                    cond_.wait_until(lk, next_time, [this] { return exiting_.load() || dirty_.load(); });
+                    dirty_ = false;
+                    continue;
+                }
+                while(!timers_.empty() && timers_.top_deadline() <= now) {
+                    expired.push_back(timers_.pop());
+                }
+                while(!periodic_.empty() && periodic_.top_deadline() <= now) {
+                    beats.push_back(periodic_.pop());
                 }
+                lk.unlock();
+                for(auto & it : expired) {
+                    if(!exiting_.load()) {
+                        auto started = metrics_.start_timer(*it);
+                        it->run_v();
+                        metrics_.finish(started);
+                    }
+                    it.reset();
+                }
+                expired.clear();
+                for(auto & it : beats) {
+                    if(exiting_.load() || it->token.cancelled()) {
+                        it.reset();
+                        continue;
+                    }
+                    auto started = metrics_.start_timer(*it);
+                    it->run_v();
+                    metrics_.finish(started);
+                    if(it->token.cancelled()) {
+                        it.reset();
+                        continue;
+                    }
+                    advance(*it, std::chrono::steady_clock::now());
+                }
+                lk.lock();
+                for(auto & it : beats) {
+                    if(it) {
+                        auto point = it->dispatch_time;
+                        metrics_.enqueue(1);
+                        periodic_.push(point, std::move(it));
+                    }
+                }
+                beats.clear();
             }
         };
-        
-        
+
+#if defined(__linux__)
+        static constexpr uint64_t wake_tag = ~uint64_t(0);
+        static constexpr uint64_t timer_tag = ~uint64_t(0) - 1;
+
+        void open_reactor() {
+            epoll_ = epoll_create1(EPOLL_CLOEXEC);
+            event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if(epoll_ < 0 || event_ < 0 || timer_ < 0) {
+                auto error = errno;
+                close_reactor();
+                throw std::system_error(error, std::generic_category(), "run_loop: reactor");
+            }
+            epoll_event ev {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = wake_tag;
+            epoll_ctl(epoll_, EPOLL_CTL_ADD, event_, &ev);
+            ev.data.u64 = timer_tag;
+            epoll_ctl(epoll_, EPOLL_CTL_ADD, timer_, &ev);
+        }
+
+        void close_reactor() {
+            for(auto fd : { epoll_, event_, timer_ }) {
+                if(fd >= 0) {
+                    ::close(fd);
+                }
+            }
+            epoll_ = event_ = timer_ = -1;
+        }
+
+        void wake_reactor() {
+            if(event_ >= 0) {
+                uint64_t one = 1;
+                (void)!::write(event_, &one, sizeof(one));
+            }
+        }
+
+        // The fd sits in the low half of the event data, the registration id in
+        // the high half, so events still queued for an unwatched fd are dropped.
+        bool reactor_arm(bool add, int fd, const io_watch& w) noexcept {
+            epoll_event ev {};
+            ev.events = ((w.interest & io_read) ? EPOLLIN : 0u) | ((w.interest & io_write) ? EPOLLOUT : 0u) | (w.oneshot ? EPOLLONESHOT : 0u);
+            ev.data.u64 = (uint64_t(w.id) << 32) | uint32_t(fd);
+            return epoll_ctl(epoll_, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == 0;
+        }
+
+        void reactor_ctl(bool add, int fd, const io_watch& w) {
+            if(!reactor_arm(add, fd, w)) {
+                throw std::system_error(errno, std::generic_category(), "run_loop: epoll_ctl");
+            }
+        }
+
+        // Sleeps in epoll_wait until the earliest timer, a watched fd or a
+        // wake-up, then runs the ready callbacks.  Called and returns locked.
+        void wait_reactor(std::unique_lock<std::mutex>& lk) {
+            if(has_timers() && next_deadline() != armed_) {
+                armed_ = next_deadline();
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(armed_.time_since_epoch()).count();
+                itimerspec spec {};
+                spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+                spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+                if(spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+                    spec.it_value.tv_nsec = 1; // zero would disarm
+                }
+                timerfd_settime(timer_, TFD_TIMER_ABSTIME, &spec, nullptr);
+            }
+            dirty_ = false;
+            lk.unlock();
+            epoll_event events[64];
+            int count = epoll_wait(epoll_, events, 64, -1);
+            lk.lock();
+            for(int i = 0 ; i < count ; i++) {
+                auto data = events[i].data.u64;
+                if(data == wake_tag || data == timer_tag) {
+                    uint64_t value;
+                    (void)!::read(data == wake_tag ? event_ : timer_, &value, sizeof(value));
+                    continue;
+                }
+                auto it = watches_.find(static_cast<int>(data & 0xffffffffu));
+                if(it == watches_.end() || it->second->id != static_cast<uint32_t>(data >> 32)) {
+                    continue;
+                }
+                auto ev = events[i].events;
+                uint32_t ready = ((ev & EPOLLIN) ? io_read : 0u) | ((ev & EPOLLOUT) ? io_write : 0u) | ((ev & (EPOLLERR | EPOLLHUP)) ? io_error : 0u);
+                ready_.emplace_back(it->second, ready);
+            }
+            if(ready_.empty()) {
+                return;
+            }
+            lk.unlock();
+            for(auto & it : ready_) {
+                if(!exiting_.load()) {
+                    it.first->callback(it.second);
+                }
+            }
+            ready_.clear();
+            lk.lock();
+        }
+#else
+        void open_reactor() {
+            throw std::logic_error("run_loop: io needs epoll");
+        }
+        void close_reactor() {}
+        void wake_reactor() {}
+        bool reactor_arm(bool, int, const io_watch&) noexcept { return true; }
+        void reactor_ctl(bool, int, const io_watch&) {}
+        void wait_reactor(std::unique_lock<std::mutex>&) {}
+#endif
+
     private:
         std::atomic<bool> exiting_;
         std::atomic<bool> dirty_;
         std::condition_variable cond_;
         std::mutex mutex_;
+        detail::timer_heap<detail::task_ptr> timers_;
+        detail::timer_heap<std::unique_ptr<detail::periodic_timer>> periodic_;
+        detail::metrics_source metrics_;
+        std::string name_ { "run_loop" };
+        int epoll_ { -1 };
+        int event_ { -1 };
+        int timer_ { -1 };
+        std::chrono::steady_clock::time_point armed_;
+        uint32_t watch_ids_ { 0 };
+        std::unordered_map<int, std::shared_ptr<io_watch>> watches_;
+        std::vector<std::pair<std::shared_ptr<io_watch>, uint32_t>> ready_;
         std::thread looper_;
     };
 }
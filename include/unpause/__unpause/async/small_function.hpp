@@ -0,0 +1,163 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_SMALL_FUNCTION_HPP
+#define UNPAUSE_ASYNC_SMALL_FUNCTION_HPP
+
+#include <type_traits>
+#include <functional>
+#include <cstddef>
+#include <utility>
+#include <new>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Move-only replacement for std::function.  Callables up to Capacity bytes
+        // that can be moved without throwing are stored inline, anything larger
+        // falls back to the heap.
+        template<class Sig, std::size_t Capacity = 4 * sizeof(void*)>
+        class small_function;
+
+        template<class R, class... Args, std::size_t Capacity>
+        class small_function<R(Args...), Capacity>
+        {
+        public:
+            small_function() noexcept : vtable_(nullptr) {};
+            small_function(std::nullptr_t) noexcept : vtable_(nullptr) {};
+
+            template<class F, class = std::enable_if_t<!std::is_same<std::decay_t<F>, small_function>::value>>
+            small_function(F&& f) : vtable_(nullptr) {
+                assign(std::forward<F>(f));
+            }
+
+            small_function(small_function&& other) noexcept : vtable_(nullptr) {
+                move_from(other);
+            }
+
+            small_function(const small_function& other) = delete;
+
+            ~small_function() { reset(); }
+
+            small_function& operator=(small_function&& other) noexcept {
+                if(this != &other) {
+                    reset();
+                    move_from(other);
+                }
+                return *this;
+            }
+
+            small_function& operator=(const small_function& other) = delete;
+
+            small_function& operator=(std::nullptr_t) noexcept {
+                reset();
+                return *this;
+            }
+
+            template<class F, class = std::enable_if_t<!std::is_same<std::decay_t<F>, small_function>::value>>
+            small_function& operator=(F&& f) {
+                reset();
+                assign(std::forward<F>(f));
+                return *this;
+            }
+
+            explicit operator bool() const noexcept { return vtable_ != nullptr; }
+
+            R operator()(Args... args) const {
+                if(!vtable_) {
+                    throw std::bad_function_call();
+                }
+                return vtable_->invoke(storage(), std::forward<Args>(args)...);
+            }
+
+            void reset() noexcept {
+                if(vtable_) {
+                    vtable_->destroy(storage());
+                    vtable_ = nullptr;
+                }
+            }
+
+            template<class F>
+            static constexpr bool stored_inline() {
+                return sizeof(F) <= Capacity && alignof(F) <= alignof(void*) && std::is_nothrow_move_constructible<F>::value;
+            }
+
+        private:
+            struct vtable {
+                R (*invoke)(void*, Args&&...);
+                void (*move)(void* dst, void* src) noexcept;
+                void (*destroy)(void*) noexcept;
+            };
+
+            template<class F>
+            struct inline_ops {
+                static R invoke(void* s, Args&&... args) { return (*static_cast<F*>(s))(std::forward<Args>(args)...); }
+                static void move(void* dst, void* src) noexcept {
+                    ::new (dst) F(std::move(*static_cast<F*>(src)));
+                    static_cast<F*>(src)->~F();
+                }
+                static void destroy(void* s) noexcept { static_cast<F*>(s)->~F(); }
+                static constexpr vtable table { &invoke, &move, &destroy };
+            };
+
+            template<class F>
+            struct heap_ops {
+                static F*& ptr(void* s) { return *static_cast<F**>(s); }
+                static R invoke(void* s, Args&&... args) { return (*ptr(s))(std::forward<Args>(args)...); }
+                static void move(void* dst, void* src) noexcept {
+                    ::new (dst) F*(ptr(src));
+                }
+                static void destroy(void* s) noexcept { delete ptr(s); }
+                static constexpr vtable table { &invoke, &move, &destroy };
+            };
+
+            template<class F>
+            static bool is_empty(const F& f) {
+                if constexpr (std::is_pointer<F>::value || std::is_member_pointer<F>::value) {
+                    return f == nullptr;
+                } else {
+                    return false;
+                }
+            }
+
+            template<class F>
+            void assign(F&& f) {
+                using functor = std::decay_t<F>;
+                if(is_empty(f)) {
+                    return;
+                }
+                if constexpr (stored_inline<functor>()) {
+                    ::new (storage()) functor(std::forward<F>(f));
+                    vtable_ = &inline_ops<functor>::table;
+                } else {
+                    ::new (storage()) functor*(new functor(std::forward<F>(f)));
+                    vtable_ = &heap_ops<functor>::table;
+                }
+            }
+
+            void move_from(small_function& other) noexcept {
+                if(other.vtable_) {
+                    other.vtable_->move(storage(), other.storage());
+                    vtable_ = other.vtable_;
+                    other.vtable_ = nullptr;
+                }
+            }
+
+            void* storage() const noexcept { return const_cast<unsigned char*>(buffer_); }
+
+            alignas(void*) mutable unsigned char buffer_[Capacity < sizeof(void*) ? sizeof(void*) : Capacity];
+            const vtable* vtable_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_SMALL_FUNCTION_HPP */
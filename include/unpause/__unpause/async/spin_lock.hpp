@@ -0,0 +1,70 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_SPIN_LOCK_HPP
+#define UNPAUSE_ASYNC_SPIN_LOCK_HPP
+
+#include <atomic>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace unpause { namespace async {
+
+    namespace detail {
+        constexpr std::size_t cache_line_size = 64;
+
+        inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield" ::: "memory");
+#endif
+        }
+
+        // Test-and-test-and-set lock for very short critical sections.
+        // Satisfies Lockable so it can be used with std::lock_guard.
+        class spin_lock {
+        public:
+            spin_lock() : locked_(false) {};
+            spin_lock(const spin_lock& other) = delete;
+            spin_lock& operator=(const spin_lock& other) = delete;
+
+            void lock() {
+                int spins = 0;
+                while(locked_.exchange(true, std::memory_order_acquire)) {
+                    while(locked_.load(std::memory_order_relaxed)) {
+                        if(++spins < 64) {
+                            cpu_relax();
+                        } else {
+                            std::this_thread::yield();
+                        }
+                    }
+                }
+            }
+
+            bool try_lock() {
+                return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire);
+            }
+
+            void unlock() {
+                locked_.store(false, std::memory_order_release);
+            }
+
+        private:
+            std::atomic<bool> locked_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_SPIN_LOCK_HPP */
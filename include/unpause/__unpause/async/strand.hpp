@@ -0,0 +1,163 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_STRAND_HPP
+#define UNPAUSE_ASYNC_STRAND_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+#include <unpause/__unpause/async/event_count.hpp>
+#include <unpause/__unpause/async/task.hpp>
+#include <unpause/__unpause/async/metrics.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Runs tasks one at a time, in submission order, on whichever thread
+        // currently owns it.  Producers push into an unbounded lock-free MPSC
+        // inbox; the producer that makes the pending count go from zero to one
+        // owns the strand and must arrange for drain() to be called.  The owner
+        // runs up to `budget` tasks per drain() and then hands the strand back
+        // through the resubmit callback, so one busy strand cannot hog a worker.
+        // Inbox nodes come from the pushing thread's task pool (task_pool.hpp).
+        class strand {
+        public:
+            explicit strand(std::size_t budget, bool listed = true)
+            : metrics("", 0, listed), budget_(budget ? budget : 1), head_(&stub_), tail_(&stub_), pending_(0), active_(0) {};
+            strand(const strand&) = delete;
+            strand& operator=(const strand&) = delete;
+
+            ~strand() {
+                auto n = tail_;
+                while(n) {
+                    auto next = n->next.load(std::memory_order_relaxed);
+                    if(n != &stub_) {
+                        free_node(n);
+                    }
+                    n = next;
+                }
+            }
+
+            // Returns true when the caller now owns the strand and must schedule drain().
+            bool push(task_ptr&& task) {
+                auto n = make_node(std::move(task));
+                auto prev = head_.exchange(n, std::memory_order_acq_rel);
+                prev->next.store(n, std::memory_order_release);
+                return pending_.fetch_add(1, std::memory_order_acq_rel) == 0;
+            }
+
+            template<class Resubmit>
+            void drain(Resubmit&& resubmit) {
+                std::size_t ran = 0;
+                for(;;) {
+                    auto available = pending_.load(std::memory_order_acquire);
+                    std::size_t batch = 0;
+                    while(batch < available && ran + batch < budget_) {
+                        auto task = pop();
+                        active_.fetch_add(1);
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        auto started = metrics.start(*task);
+                        task->run_v();
+                        metrics.finish(started);
+                        task.reset();
+                        if(active_.fetch_sub(1) == 1 && idle.has_waiters()) {
+                            idle.notify_all();
+                        }
+                        ++batch;
+                    }
+                    ran += batch;
+                    if(pending_.fetch_sub(batch) == batch) {
+                        // empty, ownership released
+                        if(idle.has_waiters()) {
+                            idle.notify_all();
+                        }
+                        return;
+                    }
+                    if(ran >= budget_) {
+                        resubmit();
+                        return;
+                    }
+                }
+            }
+
+            std::size_t size() const { return pending_.load(std::memory_order_relaxed); }
+            bool active() const { return active_.load() > 0; }
+            std::size_t budget() const { return budget_; }
+
+            // Metrics of the owning task_queue, kept here since the strand can
+            // outlive the queue.
+            metrics_source metrics;
+
+            // Notified when the strand runs out of pending or running tasks, and
+            // by the owning task_queue when it empties (task_queue::drain()).
+            event_count idle;
+
+        private:
+            struct node {
+                node() {};
+                node(task_ptr&& task, bool pooled) : task(std::move(task)), pooled(pooled) {};
+                std::atomic<node*> next { nullptr };
+                task_ptr task;
+                bool pooled { false };
+            };
+
+            static node* make_node(task_ptr&& task) {
+                if constexpr (task_pool_fits<node>()) {
+                    if(auto mem = task_pool_allocate(task_pool_class(sizeof(node)))) {
+                        return ::new (mem) node(std::move(task), true);
+                    }
+                }
+                return new node(std::move(task), false);
+            }
+
+            static void free_node(node* n) {
+                if(n->pooled) {
+                    n->~node();
+                    task_pool_free(n);
+                } else {
+                    delete n;
+                }
+            }
+
+            // Only called by the owner while pending_ says a task is there.  A
+            // producer may still be linking an earlier node, which takes a moment.
+            task_ptr pop() {
+                for(;;) {
+                    auto tail = tail_;
+                    auto next = tail->next.load(std::memory_order_acquire);
+                    if(next) {
+                        tail_ = next;
+                        auto task = std::move(next->task);
+                        if(tail != &stub_) {
+                            free_node(tail);
+                        }
+                        return task;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+
+            const std::size_t budget_;
+            node stub_;
+            alignas(cache_line_size) std::atomic<node*> head_;
+            alignas(cache_line_size) node* tail_;
+            alignas(cache_line_size) std::atomic<std::size_t> pending_;
+            std::atomic<int> active_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_STRAND_HPP */
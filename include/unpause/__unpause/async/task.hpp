@@ -11,12 +11,23 @@
 #ifndef UNPAUSE_ASYNC_TASK_HPP
 #define UNPAUSE_ASYNC_TASK_HPP
 
+#include <unpause/__unpause/async/small_function.hpp>
+#include <unpause/__unpause/async/cancel.hpp>
+#include <unpause/__unpause/async/task_pool.hpp>
+
+#include <type_traits>
 #include <functional>
+#include <cstddef>
 #include <utility>
 #include <chrono>
 #include <memory>
 #include <atomic>
 #include <tuple>
+#include <new>
+
+#ifndef UNPAUSE_ASYNC_TASK_INLINE_SIZE
+#define UNPAUSE_ASYNC_TASK_INLINE_SIZE 128
+#endif
 
 namespace unpause { namespace async {
     
@@ -24,49 +35,86 @@ namespace unpause { namespace async {
         template<class R>
         struct task_after
         {
-            using function_type = std::function<void(R&)>;
+            using function_type = small_function<void(R&)>;
         };
         
         template<>
         struct task_after<void>
         {
-            using function_type = std::function<void()>;
+            using function_type = small_function<void()>;
+        };
+
+        // Callbacks linked into a task by the code that queues or waits for it,
+        // called before and after the task runs, or is skipped once cancelled.
+        // The hook belongs to whoever links it, typically on the stack of a
+        // waiting thread, so linking one allocates nothing.  The task does not
+        // touch a hook once its after callback was called.
+        struct task_hook {
+            void (*before)(task_hook&) { nullptr };
+            void (*after)(task_hook&) { nullptr };
+            task_hook* next { nullptr };
         };
+
         struct task_container {
             task_container() : dispatch_time(std::chrono::steady_clock::now()) {};
-            task_container(task_container&& other)
-            : before_internal(std::move(other.before_internal))
-            , after_internal(std::move(other.after_internal))
-            , dispatch_time(std::move(other.dispatch_time))
-            , token(std::move(other.token))
-            , use_token(other.use_token) 
-            { other.token.reset(); other.use_token = false; }; 
+            task_container(task_container&& other) noexcept
+            : dispatch_time(std::move(other.dispatch_time))
+            , token(other.token)
+            , hooks(other.hooks)
+#if defined(UNPAUSE_ASYNC_METRICS)
+            , queued_at(other.queued_at)
+#endif
+            { other.token = cancel_token(); other.hooks = nullptr; };
 
             task_container(const task_container& other) = delete;
 
             virtual ~task_container() {};
 
             virtual void run_v() = 0;
-            std::function<void()> before_internal; // used for task_queue
-            std::function<void()> after_internal; // used for task_queue
+
+            void link(task_hook& hook) noexcept {
+                hook.next = hooks;
+                hooks = &hook;
+            }
+
+            void run_before_hooks() {
+                for(auto hook = hooks ; hook ; hook = hook->next) {
+                    if(hook->before) {
+                        hook->before(*hook);
+                    }
+                }
+            }
+
+            void run_after_hooks() {
+                auto hook = hooks;
+                hooks = nullptr;
+                while(hook) {
+                    // the owner may release the hook as soon as it was called
+                    auto next = hook->next;
+                    if(hook->after) {
+                        hook->after(*hook);
+                    }
+                    hook = next;
+                }
+            }
+
             std::chrono::steady_clock::time_point dispatch_time; // used for run_loop
-            std::weak_ptr<std::atomic<bool>> token;
-            bool use_token {false};
+            cancel_token token; // the task is skipped once cancelled
+            task_hook* hooks { nullptr }; // see link()
+#if defined(UNPAUSE_ASYNC_METRICS)
+            std::chrono::steady_clock::time_point queued_at; // used for metrics
+#endif
         };
     }
     
     template<class R, class... Args>
     struct task : public detail::task_container
     {
-        using result_type = typename std::result_of<R(Args...)>::type;
+        using result_type = std::invoke_result_t<R, Args...>;
         using after_type = typename detail::task_after<result_type>::function_type;
         
         task(R&& r, Args&&... a) : func(std::move(r)), args(std::forward<Args>(a)...) {};
-        task(task<R, Args...>&& rhs)
-        : detail::task_container(std::forward<detail::task_container>(rhs))
-        , func(std::move(rhs.func))
-        , args(std::move(rhs.args))
-        , after(std::move(rhs.after)) {};
+        task(task<R, Args...>&& rhs) = default;
         task(const task& other) = delete;
 
         virtual ~task() {};
@@ -77,57 +125,258 @@ namespace unpause { namespace async {
             return run(std::integral_constant<bool, std::is_same<result_type, void>::value>(), std::index_sequence_for<Args...>{});
         }
         
-        std::function<result_type (Args...)> func;
+        std::decay_t<R> func; // stored by value, the task_ptr holding the task decides where it lives
         std::tuple<Args...> args;
         after_type after;
 
     private:
         template<std::size_t... I>
         result_type run(std::true_type, std::index_sequence<I...>) {
-            
-            if(before_internal) {
-                before_internal();
-            }
-            auto t = token.lock();
-            if(!use_token || (use_token && t && t->load(std::memory_order_acquire))) {
+            run_before_hooks();
+            if(!token.cancelled()) {
                 func(std::get<I>(std::forward<std::tuple<Args...>>(args)) ...);
                 if(after) {
                     after();
                 }
             }
-            if(after_internal) {
-                after_internal();
-            } 
-            
+            run_after_hooks();
         }
         
         template<std::size_t... I>
         result_type run(std::false_type, std::index_sequence<I...>) {
             result_type res = result_type();
-            
-            if(before_internal) {
-                before_internal();
-            }
-            auto t = token.lock();
-            if(!use_token || (use_token && t && t->load(std::memory_order_acquire))) {
+            run_before_hooks();
+            if(!token.cancelled()) {
                 res = func(std::get<I>(std::forward<std::tuple<Args...>>(args)) ...);
                 if(after) {
                     after(res);
                 }
-            } 
-            if(after_internal) {
-                after_internal();
             }
-        
+            run_after_hooks();
             return res;
         }
     };
     
+    namespace detail {
+        // After callback of a static_task that has none.
+        struct no_after {
+            template<class... T>
+            void operator()(T&&...) const noexcept {}
+        };
+
+        struct replace_after_tag {};
+    }
+
+    // Statically typed task: the callable R and the completion callback After
+    // are stored by value, without type erasure, and the queue machinery links
+    // task_hooks instead of assigning callbacks.  Calling one is a direct call
+    // that the compiler can inline.  After receives the result, like
+    // task::after.
+    template<class R, class After, class... Args>
+    struct static_task : public detail::task_container
+    {
+        using result_type = std::invoke_result_t<R&, Args...>;
+
+        template<class F, class A, class... T>
+        static_task(F&& f, A&& a, T&&... t) : func(std::forward<F>(f)), after(std::forward<A>(a)), args(std::forward<T>(t)...) {}
+        static_task(static_task&& rhs) noexcept(std::is_nothrow_move_constructible<R>::value && std::is_nothrow_move_constructible<After>::value && std::is_nothrow_move_constructible<std::tuple<Args...>>::value)
+        : detail::task_container(std::forward<detail::task_container>(rhs))
+        , func(std::move(rhs.func))
+        , after(std::move(rhs.after))
+        , args(std::move(rhs.args)) {};
+        static_task(const static_task& other) = delete;
+
+        // Takes over other, with a as the after callback.
+        template<class OtherAfter, class A>
+        static_task(static_task<R, OtherAfter, Args...>&& other, A&& a, detail::replace_after_tag)
+        : detail::task_container(static_cast<detail::task_container&&>(other))
+        , func(std::move(other.func))
+        , after(std::forward<A>(a))
+        , args(std::move(other.args)) {}
+
+        virtual void run_v() { (*this)(); }
+
+        result_type operator()() {
+            if(hooks) {
+                run_before_hooks();
+            }
+            if constexpr (std::is_void<result_type>::value) {
+                if(!token.cancelled()) {
+                    std::apply(func, std::move(args));
+                    after();
+                }
+                if(hooks) {
+                    run_after_hooks();
+                }
+            } else {
+                result_type res = result_type();
+                if(!token.cancelled()) {
+                    res = std::apply(func, std::move(args));
+                    after(res);
+                }
+                if(hooks) {
+                    run_after_hooks();
+                }
+                return res;
+            }
+        }
+
+        // The same task with a as its after callback.
+        template<class A>
+        static_task<R, std::decay_t<A>, Args...> then(A&& a) && {
+            return static_task<R, std::decay_t<A>, Args...>(std::move(*this), std::forward<A>(a), detail::replace_after_tag());
+        }
+
+        R func;
+        After after;
+        std::tuple<Args...> args;
+    };
+
+    namespace detail {
+
+        // Owning handle to a task_container, used like a std::unique_ptr.  Tasks
+        // that fit in UNPAUSE_ASYNC_TASK_INLINE_SIZE bytes live inside the handle
+        // itself so queues can store them by value without a heap allocation.
+        // Larger ones come from the calling thread's task pool (task_pool.hpp).
+        class task_ptr
+        {
+        public:
+            static constexpr std::size_t inline_size = UNPAUSE_ASYNC_TASK_INLINE_SIZE;
+
+            task_ptr() noexcept : ptr_(nullptr), manage_(nullptr) {};
+            task_ptr(std::nullptr_t) noexcept : task_ptr() {};
+            task_ptr(std::unique_ptr<task_container>&& task) noexcept : ptr_(task.release()), manage_(ptr_ ? &manage_heap : nullptr) {};
+            task_ptr(task_ptr&& other) noexcept : task_ptr() { move_from(other); }
+            task_ptr(const task_ptr& other) = delete;
+            ~task_ptr() { reset(); }
+
+            task_ptr& operator=(task_ptr&& other) noexcept {
+                if(this != &other) {
+                    reset();
+                    move_from(other);
+                }
+                return *this;
+            }
+            task_ptr& operator=(const task_ptr& other) = delete;
+
+            template<class T, class... A>
+            static task_ptr make(A&&... a) {
+                task_ptr p;
+                if constexpr (stored_inline<T>()) {
+                    p.ptr_ = ::new (p.buffer_) T(std::forward<A>(a)...);
+                    p.manage_ = &manage_inline<T>;
+                } else if constexpr (task_pool_fits<T>()) {
+                    auto mem = task_pool_allocate(task_pool_class(sizeof(T)));
+                    if(mem) {
+                        try {
+                            p.ptr_ = ::new (mem) T(std::forward<A>(a)...);
+                        } catch(...) {
+                            task_pool_free(mem);
+                            throw;
+                        }
+                        p.manage_ = &manage_pooled<T>;
+                    } else {
+                        p.ptr_ = new T(std::forward<A>(a)...);
+                        p.manage_ = &manage_heap;
+                    }
+                } else {
+                    p.ptr_ = new T(std::forward<A>(a)...);
+                    p.manage_ = &manage_heap;
+                }
+                return p;
+            }
+
+            template<class T>
+            static constexpr bool stored_inline() {
+                return sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<T>::value;
+            }
+
+            explicit operator bool() const noexcept { return ptr_ != nullptr; }
+            task_container* operator->() const noexcept { return ptr_; }
+            task_container& operator*() const noexcept { return *ptr_; }
+            task_container* get() const noexcept { return ptr_; }
+            bool is_inline() const noexcept { return ptr_ && static_cast<void*>(ptr_) == static_cast<const void*>(buffer_); }
+
+            void reset() noexcept {
+                if(ptr_) {
+                    manage_(nullptr, this);
+                    ptr_ = nullptr;
+                    manage_ = nullptr;
+                }
+            }
+
+        private:
+            // manage(dst, src): moves src into dst, or destroys src when dst is null.
+            using manager = void (*)(task_ptr* dst, task_ptr* src) noexcept;
+
+            template<class T>
+            static void manage_inline(task_ptr* dst, task_ptr* src) noexcept {
+                T* obj = static_cast<T*>(src->ptr_);
+                if(dst) {
+                    dst->ptr_ = ::new (dst->buffer_) T(std::move(*obj));
+                }
+                obj->~T();
+            }
+
+            template<class T>
+            static void manage_pooled(task_ptr* dst, task_ptr* src) noexcept {
+                if(dst) {
+                    dst->ptr_ = src->ptr_;
+                } else {
+                    T* obj = static_cast<T*>(src->ptr_);
+                    obj->~T();
+                    task_pool_free(obj);
+                }
+            }
+
+            static void manage_heap(task_ptr* dst, task_ptr* src) noexcept {
+                if(dst) {
+                    dst->ptr_ = src->ptr_;
+                } else {
+                    delete src->ptr_;
+                }
+            }
+
+            void move_from(task_ptr& other) noexcept {
+                if(other.ptr_) {
+                    other.manage_(this, &other);
+                    manage_ = other.manage_;
+                    other.ptr_ = nullptr;
+                    other.manage_ = nullptr;
+                }
+            }
+
+            task_container* ptr_;
+            manager manage_;
+            alignas(std::max_align_t) unsigned char buffer_[inline_size];
+        };
+    }
+
+    namespace detail {
+        inline task_ptr make_task_ptr(task_ptr&& t) { return std::move(t); }
+        inline task_ptr make_task_ptr(std::unique_ptr<task_container>&& t) { return task_ptr(std::move(t)); }
+
+        template<class R, class... Args>
+        inline task_ptr make_task_ptr(task<R, Args...>&& t) { return task_ptr::make<task<R, Args...>>(std::move(t)); }
+
+        template<class R, class After, class... Args>
+        inline task_ptr make_task_ptr(static_task<R, After, Args...>&& t) { return task_ptr::make<static_task<R, After, Args...>>(std::move(t)); }
+    }
+
     template<class R, class... Args>
     inline task<R,Args...> make_task(R&& r, Args&&... args)
     {
         return task<R, Args...>(std::forward<R>(r), std::forward<Args>(args)...);
     }
+
+    // The callable and the arguments are stored decayed, like std::thread
+    // does; use std::ref to pass a reference.  Set the after callback with
+    // then().
+    template<class R, class... Args>
+    inline static_task<std::decay_t<R>, detail::no_after, std::decay_t<Args>...> make_static_task(R&& r, Args&&... args)
+    {
+        return static_task<std::decay_t<R>, detail::no_after, std::decay_t<Args>...>(std::forward<R>(r), detail::no_after(), std::forward<Args>(args)...);
+    }
 }
 }
 #endif /* UNPAUSE_ASYNC_TASK_HPP */
@@ -0,0 +1,310 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_TASK_POOL_HPP
+#define UNPAUSE_ASYNC_TASK_POOL_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Tasks too large to be stored inline in a task_ptr are allocated from
+// per-thread size-class pools instead of operator new when this is non-zero.
+#ifndef UNPAUSE_ASYNC_TASK_POOL
+#define UNPAUSE_ASYNC_TASK_POOL 1
+#endif
+
+namespace unpause { namespace async {
+
+    // Counters of the task allocator, over every thread since start.
+    struct task_pool_stats {
+        uint64_t allocated { 0 };       // blocks handed out
+        uint64_t freed { 0 };           // blocks given back, remote frees included
+        uint64_t remote_freed { 0 };    // given back by another thread than the allocating one
+        uint64_t slabs { 0 };           // slabs reserved, they are reused but never released
+        uint64_t reserved_bytes { 0 };
+    };
+
+    namespace detail {
+
+        // Memory is reserved in slabs of slab_size bytes aligned on slab_size,
+        // so the slab of a block is found by masking its address.  A slab holds
+        // blocks of one size class and belongs to one thread, which allocates
+        // and frees its blocks without atomics.  Other threads push the blocks
+        // they free onto the slab's remote list; the owner takes the whole
+        // list back in one exchange when its local free list runs dry.  Slabs
+        // of an exiting thread are handed over to the next thread that needs
+        // a slab of the same class.
+        constexpr std::size_t task_pool_slab_size = 64 * 1024;
+        constexpr std::size_t task_pool_min_block = 64;
+        constexpr std::size_t task_pool_classes = 7; // 64 to 4096 bytes
+
+        constexpr std::size_t task_pool_class(std::size_t size) {
+            std::size_t c = 0;
+            while(c < task_pool_classes && (task_pool_min_block << c) < size) {
+                c++;
+            }
+            return c;
+        }
+
+        template<class T>
+        constexpr bool task_pool_fits() {
+            return UNPAUSE_ASYNC_TASK_POOL && task_pool_class(sizeof(T)) < task_pool_classes && alignof(T) <= alignof(std::max_align_t);
+        }
+
+        struct task_pool_cache;
+
+        struct task_pool_block {
+            task_pool_block* next;
+        };
+
+        struct task_pool_slab {
+            task_pool_slab(std::size_t size_class, task_pool_cache* cache)
+            : owner(cache), block_size(task_pool_min_block << size_class), size_class(size_class)
+            , bump(reinterpret_cast<char*>(this) + first_block), end(reinterpret_cast<char*>(this) + task_pool_slab_size) {};
+
+            static task_pool_slab* of(void* block) {
+                return reinterpret_cast<task_pool_slab*>(reinterpret_cast<uintptr_t>(block) & ~static_cast<uintptr_t>(task_pool_slab_size - 1));
+            }
+
+            // Owner only.
+            void* allocate() {
+                if(!free) {
+                    if(bump + block_size <= end) {
+                        auto res = bump;
+                        bump += block_size;
+                        return res;
+                    }
+                    free = remote.exchange(nullptr, std::memory_order_acquire);
+                    if(!free) {
+                        return nullptr;
+                    }
+                }
+                auto res = free;
+                free = res->next;
+                return res;
+            }
+
+            bool available() const {
+                return free || bump + block_size <= end || remote.load(std::memory_order_relaxed);
+            }
+
+            void free_remote(task_pool_block* block) {
+                auto head = remote.load(std::memory_order_relaxed);
+                do {
+                    block->next = head;
+                } while(!remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+            }
+
+            static constexpr std::size_t first_block = 2 * cache_line_size;
+
+            std::atomic<task_pool_cache*> owner;
+            const std::size_t block_size;
+            const std::size_t size_class;
+            task_pool_block* free { nullptr };
+            char* bump;
+            char* const end;
+            task_pool_slab* next_abandoned { nullptr };
+            alignas(cache_line_size) std::atomic<task_pool_block*> remote { nullptr };
+        };
+
+        static_assert(sizeof(task_pool_slab) <= task_pool_slab::first_block, "slab header overlaps the first block");
+
+        // Per-thread state, the counters are only written by their thread.
+        struct task_pool_cache {
+            std::array<task_pool_slab*, task_pool_classes> current {};
+            std::array<std::vector<task_pool_slab*>, task_pool_classes> slabs;
+            std::atomic<uint64_t> allocated { 0 };
+            std::atomic<uint64_t> freed { 0 };
+            std::atomic<uint64_t> remote_freed { 0 };
+        };
+
+        inline void task_pool_count(std::atomic<uint64_t>& counter) {
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        class task_pool_registry {
+        public:
+            static task_pool_registry& instance() {
+                static task_pool_registry registry;
+                return registry;
+            }
+
+            void attach(task_pool_cache* cache) {
+                std::lock_guard<std::mutex> lk(mutex_);
+                caches_.push_back(cache);
+            }
+
+            // The thread of cache exits: its slabs wait for another owner.
+            void detach(task_pool_cache* cache) {
+                std::lock_guard<std::mutex> lk(mutex_);
+                caches_.erase(std::remove(caches_.begin(), caches_.end(), cache), caches_.end());
+                retired_.allocated += cache->allocated.load(std::memory_order_relaxed);
+                retired_.freed += cache->freed.load(std::memory_order_relaxed);
+                retired_.remote_freed += cache->remote_freed.load(std::memory_order_relaxed);
+                for(auto & list : cache->slabs) {
+                    for(auto slab : list) {
+                        slab->owner.store(nullptr, std::memory_order_release);
+                        slab->next_abandoned = abandoned_[slab->size_class];
+                        abandoned_[slab->size_class] = slab;
+                    }
+                }
+            }
+
+            task_pool_slab* adopt(std::size_t size_class, task_pool_cache* cache) {
+                std::lock_guard<std::mutex> lk(mutex_);
+                auto slab = abandoned_[size_class];
+                if(slab) {
+                    abandoned_[size_class] = slab->next_abandoned;
+                    slab->next_abandoned = nullptr;
+                    slab->owner.store(cache, std::memory_order_release);
+                }
+                return slab;
+            }
+
+            task_pool_slab* reserve(std::size_t size_class, task_pool_cache* cache) {
+                auto mem = ::operator new(task_pool_slab_size, std::align_val_t(task_pool_slab_size));
+                slabs_.fetch_add(1, std::memory_order_relaxed);
+                return ::new (mem) task_pool_slab(size_class, cache);
+            }
+
+            // An exiting thread frees a block.
+            void count_late_free() {
+                late_freed_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            task_pool_stats snapshot() {
+                std::lock_guard<std::mutex> lk(mutex_);
+                auto res = retired_;
+                for(auto cache : caches_) {
+                    res.allocated += cache->allocated.load(std::memory_order_relaxed);
+                    res.freed += cache->freed.load(std::memory_order_relaxed);
+                    res.remote_freed += cache->remote_freed.load(std::memory_order_relaxed);
+                }
+                auto late = late_freed_.load(std::memory_order_relaxed);
+                res.freed += late;
+                res.remote_freed += late;
+                res.slabs = slabs_.load(std::memory_order_relaxed);
+                res.reserved_bytes = res.slabs * task_pool_slab_size;
+                return res;
+            }
+
+        private:
+            std::mutex mutex_;
+            std::vector<task_pool_cache*> caches_;
+            std::array<task_pool_slab*, task_pool_classes> abandoned_ {};
+            task_pool_stats retired_;
+            std::atomic<uint64_t> late_freed_ { 0 };
+            std::atomic<uint64_t> slabs_ { 0 };
+        };
+
+        // Trivially destructible so that it stays readable while the thread's
+        // other thread_local objects are destroyed.
+        struct task_pool_tls {
+            task_pool_cache* cache;
+            bool exited;
+        };
+
+        inline task_pool_tls& task_pool_state() {
+            static thread_local task_pool_tls state { nullptr, false };
+            return state;
+        }
+
+        struct task_pool_exit {
+            ~task_pool_exit() {
+                auto& state = task_pool_state();
+                if(state.cache) {
+                    task_pool_registry::instance().detach(state.cache);
+                    delete state.cache;
+                }
+                state.cache = nullptr;
+                state.exited = true;
+            }
+        };
+
+        // Null once the thread is exiting, callers fall back to operator new.
+        inline task_pool_cache* task_pool_thread_cache() {
+            auto& state = task_pool_state();
+            if(!state.cache && !state.exited) {
+                static thread_local task_pool_exit on_exit;
+                state.cache = new task_pool_cache();
+                task_pool_registry::instance().attach(state.cache);
+            }
+            return state.cache;
+        }
+
+        // Switches the cache to a slab of size_class with a free block: one of
+        // its own, one left by an exited thread, or a new one.
+        inline task_pool_slab* task_pool_refill(task_pool_cache& cache, std::size_t size_class) {
+            for(auto slab : cache.slabs[size_class]) {
+                if(slab != cache.current[size_class] && slab->available()) {
+                    return cache.current[size_class] = slab;
+                }
+            }
+            auto& registry = task_pool_registry::instance();
+            auto slab = registry.adopt(size_class, &cache);
+            if(!slab) {
+                slab = registry.reserve(size_class, &cache);
+            }
+            cache.slabs[size_class].push_back(slab);
+            return cache.current[size_class] = slab;
+        }
+
+        // Returns a block of size_class, or null when the calling thread is
+        // exiting.
+        inline void* task_pool_allocate(std::size_t size_class) {
+            auto cache = task_pool_thread_cache();
+            if(!cache) {
+                return nullptr;
+            }
+            auto slab = cache->current[size_class];
+            void* res = slab ? slab->allocate() : nullptr;
+            while(!res) {
+                // an adopted slab may be full, keep looking
+                res = task_pool_refill(*cache, size_class)->allocate();
+            }
+            task_pool_count(cache->allocated);
+            return res;
+        }
+
+        inline void task_pool_free(void* p) {
+            auto slab = task_pool_slab::of(p);
+            auto block = static_cast<task_pool_block*>(p);
+            auto cache = task_pool_thread_cache();
+            if(cache && slab->owner.load(std::memory_order_relaxed) == cache) {
+                block->next = slab->free;
+                slab->free = block;
+                task_pool_count(cache->freed);
+                return;
+            }
+            slab->free_remote(block);
+            if(cache) {
+                task_pool_count(cache->freed);
+                task_pool_count(cache->remote_freed);
+            } else {
+                task_pool_registry::instance().count_late_free();
+            }
+        }
+    }
+
+    inline task_pool_stats task_pool_snapshot() {
+        return detail::task_pool_registry::instance().snapshot();
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_TASK_POOL_HPP */
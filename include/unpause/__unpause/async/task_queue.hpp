@@ -11,56 +11,123 @@
 #ifndef UNPAUSE_ASYNC_TASK_QUEUE_HPP
 #define UNPAUSE_ASYNC_TASK_QUEUE_HPP
 
+#include <unpause/__unpause/async/strand.hpp>
+
 #include <algorithm>
 #include <cassert>
 #include <thread>
 #include <chrono>
 #include <memory>
 #include <atomic>
-#include <deque>
 #include <mutex>
 
 namespace unpause { namespace async {
 
+    enum class queue_backend {
+        locked,     // unbounded, mutex protected, supports sort() and next_dispatch_time()
+        lock_free   // bounded MPMC ring, add() waits for a free slot when the ring is full
+    };
+
+    enum class shutdown_mode {
+        graceful,   // let queued tasks run first
+        cancel      // skip queued tasks, wait only for those already running
+    };
+
+    struct task_queue_options {
+        queue_backend backend { queue_backend::locked };
+        std::size_t capacity { 1024 }; // lock_free only, rounded up to a power of two
+
+        // run(pool, queue, ...) runs up to this many tasks of the queue on one
+        // worker before handing the queue back to the pool.
+        std::size_t strand_budget { 64 };
+
+        // List the queue in metrics_snapshot() (needs UNPAUSE_ASYNC_METRICS).
+        bool metrics { true };
+
+        // Group the queue's cancellation group is nested in, cancelling it
+        // cancels the queue's pending tasks too.
+        cancel_token cancel_parent;
+    };
+
     struct task_queue
     {
-        task_queue() : token(std::make_shared<std::atomic<bool>>(true)), complete(false), end_sem_(0), count_(0) {};
+        task_queue() : task_queue(task_queue_options()) {};
+        task_queue(const task_queue_options& options)
+        : cancellation(options.cancel_parent), complete(false)
+        , strand_(std::make_shared<detail::strand>(options.strand_budget, options.metrics)), count_(0) {
+            if(options.backend == queue_backend::lock_free) {
+                ring_ = std::make_unique<detail::mpmc_ring<detail::task_ptr>>(options.capacity);
+            }
+        };
         task_queue(const task_queue& other) = delete;
         task_queue(task_queue&& other) = delete;
         task_queue& operator=(const task_queue& other) = delete;
         task_queue& operator=(task_queue&& other) = delete;
 
-        // TODO: replace with a more robust semaphore implementation.
-        // Final tasks have 5 seconds to finish.  If it needs more time, use run_sync.
+        // Final tasks have 5 seconds to finish.  If it needs more time, use
+        // shutdown() or run_sync.
         ~task_queue() { 
-            mutex_internal_.lock();
-            token->store(false, std::memory_order_release);
-            complete = true; 
-            token.reset();
-            tasks_.clear();
-            mutex_internal_.unlock();
-            auto start = std::chrono::steady_clock::now();
-            while(end_sem_.load() > 0 && ((std::chrono::steady_clock::now() - start) < std::chrono::seconds(5))) { std::this_thread::yield(); }
+            close();
+            wait_in_flight(std::chrono::steady_clock::now() + std::chrono::seconds(5));
         };
+
+        // Blocks until every task added so far has run, whether through next()
+        // or run(pool, queue, ...), and no call into the queue is in progress.
+        // Returns false if that did not happen by deadline.  The queue stays
+        // open; tasks added meanwhile are waited for too.
+        bool drain(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+            for(;;) {
+                if(!in_flight_.wait_until(deadline)) {
+                    return false;
+                }
+                auto empty = [this] { return size() == 0 && strand_->size() == 0; };
+                if(!strand_->idle.wait_until(empty, deadline)) {
+                    return false;
+                }
+                if(in_flight_.count() == 0 && empty()) {
+                    return true;
+                }
+            }
+        }
+
+        // Closes the queue: later additions are ignored and tasks still queued
+        // are cancelled, after draining them first in graceful mode.  Then waits
+        // for tasks already running.  Returns true when everything finished by
+        // deadline (graceful) or nothing was left running (cancel).
+        bool shutdown(shutdown_mode mode = shutdown_mode::graceful, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+            bool drained = mode == shutdown_mode::cancel || drain(deadline);
+            close();
+            return wait_in_flight(deadline) && drained;
+        }
         
         template<class R, class... Args>
         void add(task<R, Args...>& t) {
-            std::unique_ptr<detail::task_container> nt = std::make_unique<task<R, Args...>>(std::forward<task<R, Args...>>(t));
-            add(std::move(nt));
+            add(detail::task_ptr::make<task<R, Args...>>(std::forward<task<R, Args...>>(t)));
+        }
+
+        template<class R, class After, class... Args>
+        void add(static_task<R, After, Args...>& t) {
+            add(detail::task_ptr::make<static_task<R, After, Args...>>(std::move(t)));
         }
         
         void add(std::unique_ptr<detail::task_container>&& task) {
-            std::weak_ptr<std::atomic<bool>> tkn = token;
-            
-            if(!tkn.expired() && !complete.load()) {
+            add(detail::task_ptr(std::move(task)));
+        }
+
+        void add(detail::task_ptr&& task) {
+            if(ring_) {
+                ring_add(std::move(task));
+                return;
+            }
+            if(!complete.load()) {
                 inc_lock();
                 {
                     std::lock_guard<std::mutex> lk(mutex_internal_);
-                    if(!tkn.expired() && !complete.load()) {
-                        if(!task->use_token) {
-                            task->token = token;
-                            task->use_token = true;
+                    if(!complete.load()) {
+                        if(!task->token.valid()) {
+                            task->token = cancellation.token();
                         }
+                        strand_->metrics.enqueue(*task);
                         tasks_.push_back(std::move(task));
                         std::atomic_thread_fence(std::memory_order_release);
                         count_.fetch_add(1, std::memory_order_relaxed);
@@ -71,32 +138,68 @@ namespace unpause { namespace async {
             
         }
         
+        // Adds every task in [first, last) under a single lock acquisition.  The
+        // elements (tasks, task_ptrs or unique_ptrs) are moved from.
+        template<class It>
+        void add_range(It first, It last) {
+            if(ring_) {
+                for(; first != last ; ++first) {
+                    ring_add(detail::make_task_ptr(std::move(*first)));
+                }
+                return;
+            }
+            if(!complete.load()) {
+                inc_lock();
+                {
+                    std::lock_guard<std::mutex> lk(mutex_internal_);
+                    if(!complete.load()) {
+                        int64_t added = 0;
+                        for(; first != last ; ++first) {
+                            auto task = detail::make_task_ptr(std::move(*first));
+                            if(!task->token.valid()) {
+                                task->token = cancellation.token();
+                            }
+                            strand_->metrics.enqueue(*task);
+                            tasks_.push_back(std::move(task));
+                            ++added;
+                        }
+                        std::atomic_thread_fence(std::memory_order_release);
+                        count_.fetch_add(added, std::memory_order_relaxed);
+                    }
+                }
+                dec_lock();
+            }
+        }
+
         template<class R, class... Args>
         void add(R&& r, Args&&... a) {
-            std::unique_ptr<detail::task_container> nt = std::make_unique<task<R, Args...>>(std::forward<R>(r), std::forward<Args>(a)...);
-            add(std::move(nt));
-            
+            add(detail::task_ptr::make<task<R, Args...>>(std::forward<R>(r), std::forward<Args>(a)...));
         }
         
         void inc_lock() {
-            ++end_sem_;
+            in_flight_.enter();
         }
         
         void dec_lock() {
-            --end_sem_;
+            in_flight_.leave();
         }
 
         bool next() {
             inc_lock();
             auto f = next_pop();
             if(f && !complete.load()) {
+                auto started = strand_->metrics.start(*f);
                 f->run_v();
+                strand_->metrics.finish(started);
             }
             dec_lock();
             return has_next();
         }
         
         bool has_next() {
+            if(ring_) {
+                return !complete.load() && !ring_->empty();
+            }
             if(!complete.load()) {
                 std::atomic_thread_fence(std::memory_order_acquire);
                 auto count = count_.load(std::memory_order_relaxed);
@@ -106,37 +209,42 @@ namespace unpause { namespace async {
         }
         
         std::chrono::steady_clock::time_point next_dispatch_time() {
-            std::weak_ptr<std::atomic<bool>> tkn = token;
-            
-            if(!tkn.expired() && !complete.load()) {
+            auto res = std::chrono::steady_clock::time_point::min();
+            if(!ring_ && !complete.load()) {
                 inc_lock();
                 {
 
                     std::lock_guard<std::mutex> lk(mutex_internal_);
-                    if(!tkn.expired() && has_next()) {
-                        return tasks_.front()->dispatch_time;
+                    if(has_next()) {
+                        res = tasks_.front()->dispatch_time;
                     }
                 }
                 dec_lock();
             }
             
-            return std::chrono::steady_clock::time_point::min();
+            return res;
         }
         
-        std::unique_ptr<detail::task_container> next_pop() {
-            std::unique_ptr<detail::task_container> f = nullptr;
-            std::weak_ptr<std::atomic<bool>> tkn = token;
-            
-            if(!tkn.expired() && !complete.load()) {
+        detail::task_ptr next_pop() {
+            detail::task_ptr f;
+            if(ring_) {
+                inc_lock();
+                if(!complete.load() && ring_->try_pop(f) && ring_->empty()) {
+                    strand_->idle.notify_all();
+                }
+                dec_lock();
+                return f;
+            }
+            if(!complete.load()) {
                 inc_lock(); 
                 {
                     std::lock_guard<std::mutex> lk(mutex_internal_);
-                    if(!tkn.expired() && has_next()) {
+                    if(has_next()) {
                         std::atomic_thread_fence(std::memory_order_acquire);
-                        auto& task = tasks_.front();
-                        f = std::move(task);
-                        tasks_.pop_front();
-                        count_.fetch_sub(1, std::memory_order_relaxed);
+                        f = tasks_.pop_front();
+                        if(count_.fetch_sub(1) == 1 && strand_->idle.has_waiters()) {
+                            strand_->idle.notify_all();
+                        }
                     }
                 }
                 dec_lock();
@@ -146,12 +254,12 @@ namespace unpause { namespace async {
         }
         
         void sort(std::function<bool(const detail::task_container& lhs, const detail::task_container& rhs)> predicate) {
-            std::weak_ptr<std::atomic<bool>> tkn = token;
-            if(!tkn.expired() && !complete.load()) {
+            if(!ring_ && !complete.load()) {
                 inc_lock();
                 mutex_internal_.lock();
-                if(!tkn.expired() && !complete.load()) {
-                    std::sort(tasks_.begin(), tasks_.end(), [predicate](std::unique_ptr<detail::task_container>& lhs, std::unique_ptr<detail::task_container>& rhs) {
+                if(!complete.load()) {
+                    auto first = tasks_.linearize();
+                    std::sort(first, first + tasks_.size(), [&predicate](const detail::task_ptr& lhs, const detail::task_ptr& rhs) {
                         return predicate(*lhs, *rhs);
                     });
                 }   
@@ -163,17 +271,79 @@ namespace unpause { namespace async {
         
         void set_name(const std::string& name) {
             name_ = name;
+            strand_->metrics.set_name(name);
         }
 
         const std::string name() const { return name_; }
 
-        std::shared_ptr<std::atomic<bool>> token;
-        std::mutex task_mutex;
+        // Counters of tasks added to and run from this queue, including tasks
+        // run serially on a pool through run(pool, queue, ...).
+        queue_metrics metrics() const {
+            auto res = strand_->metrics.snapshot();
+            res.name = name_;
+            return res;
+        }
+
+        // Serial execution state used by run(pool, queue, ...).  Shared so that a
+        // drain already queued on a pool can outlive the queue.
+        const std::shared_ptr<detail::strand>& strand() const { return strand_; }
+
+        std::size_t size() {
+            if(ring_) {
+                return ring_->size();
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto count = count_.load(std::memory_order_relaxed);
+            return count > 0 ? static_cast<std::size_t>(count) : 0;
+        }
+
+        // Tasks added to the queue take a token of this group unless they
+        // already carry one; cancellation.cancel() skips every task added so far.
+        cancel_group cancellation;
+
+        // Token of the tasks added from now on, cancelled once the queue is
+        // cancelled, shut down or destroyed.  Stands in for the shared flag
+        // the queue used to expose as its token member.
+        cancel_token token() const { return cancellation.token(); }
+
         std::atomic<bool> complete;
     private:
-        std::deque<std::unique_ptr<detail::task_container>> tasks_;
+        void close() {
+            if(ring_) {
+                cancellation.cancel();
+                complete = true;
+                return;
+            }
+            std::lock_guard<std::mutex> lk(mutex_internal_);
+            cancellation.cancel();
+            complete = true;
+            tasks_.clear();
+        }
+
+        // Waits for calls into the queue and for the task its strand is running.
+        bool wait_in_flight(std::chrono::steady_clock::time_point deadline) {
+            return in_flight_.wait_until(deadline) && strand_->idle.wait_until([this] { return !strand_->active(); }, deadline);
+        }
+
+        void ring_add(detail::task_ptr&& task) {
+            inc_lock();
+            if(!complete.load()) {
+                if(!task->token.valid()) {
+                    task->token = cancellation.token();
+                }
+                strand_->metrics.enqueue(*task);
+                while(!ring_->try_push(task) && !complete.load()) {
+                    std::this_thread::yield();
+                }
+            }
+            dec_lock();
+        }
+
+        detail::ring_buffer<detail::task_ptr> tasks_;
+        std::unique_ptr<detail::mpmc_ring<detail::task_ptr>> ring_;
+        std::shared_ptr<detail::strand> strand_;
         std::mutex mutex_internal_;
-        std::atomic<int> end_sem_;
+        detail::inflight_latch in_flight_;
         std::atomic<int64_t> count_;
         std::string name_;
     };
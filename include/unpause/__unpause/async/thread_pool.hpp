@@ -11,52 +11,999 @@
 #ifndef UNPAUSE_ASYNC_THREAD_POOL_HPP
 #define UNPAUSE_ASYNC_THREAD_POOL_HPP
 
+#include <unpause/__unpause/async/event_count.hpp>
+#include <unpause/__unpause/async/topology.hpp>
+#include <unpause/__unpause/async/metrics.hpp>
+
 #include <condition_variable>
+#include <algorithm>
 #include <optional>
+#include <array>
+#include <cstdint>
+#include <climits>
+#include <stdexcept>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <chrono>
+#include <memory>
 #include <atomic>
 #include <thread>
-#include <list>
+#include <mutex>
+#include <vector>
 
 namespace unpause { namespace async {
-    
+
+    // Lanes of the shared queue, drained highest first.  run(pool, ...) without
+    // a priority uses priority::normal.
+    enum class priority { high, normal, low, background };
+    constexpr std::size_t priority_levels = 4;
+
+    struct thread_pool_options {
+        int thread_count { static_cast<int>(std::thread::hardware_concurrency()) };
+
+        // Give each worker its own deque.  Tasks submitted from a worker go to its
+        // deque (popped LIFO), tasks submitted from outside the pool go to the
+        // shared injector queue, and idle workers steal FIFO from each other.
+        bool work_stealing { false };
+
+        // Backend for the shared tasks queue.  With a bounded lock_free queue,
+        // tasks that submit more work from a worker can block on a full queue
+        // unless work_stealing is also enabled.
+        task_queue_options queue;
+
+        // Number of times an idle worker polls for work before parking.  Parked
+        // workers sleep until a submission wakes them, there is no periodic
+        // timeout.  Negative picks a default (no spinning on a single core).
+        int idle_spins { -1 };
+
+        // A lane that still has work after this many tasks were taken from
+        // higher lanes gets the next one, so lower lanes cannot starve.  Zero
+        // disables aging (strict priority).
+        int priority_aging { 32 };
+
+        // Pin each worker to one CPU (Linux only).
+        bool pin_threads { false };
+
+        // Spread workers over the NUMA nodes with one shared queue per node.
+        // Submissions go to the queue of the submitting thread's node and
+        // workers only take from other nodes when their own has nothing.
+        bool numa_aware { false };
+
+        // Nodes and CPUs to use; empty reads them with numa_topology().
+        std::vector<numa_node> topology;
+
+        // Elastic sizing, enabled when above thread_count.  The pool keeps at
+        // least thread_count workers and starts more, up to max_threads, while
+        // tasks are waiting and fewer than thread_count workers can make
+        // progress: workers inside a blocking_section, or running the same task
+        // for longer than stall_timeout, do not count.  Workers above
+        // thread_count retire after idle_timeout without work.
+        int max_threads { 0 };
+        std::chrono::milliseconds idle_timeout { 5000 };
+        std::chrono::milliseconds stall_timeout { 20 };
+
+        // Drop tasks submitted with a deadline that has already passed when a
+        // worker picks them up, instead of running them late.
+        bool shed_expired { false };
+
+        // Tasks submitted from a worker go to that worker's next slot and run
+        // right after the current task, on the same thread, while their data
+        // is still in cache.  A task already in the slot is queued as usual.
+        // Other workers take from the slot only when they find nothing else.
+        bool next_slot { false };
+    };
+
+    // Tasks submitted with a deadline that finished after it, and that were
+    // dropped unrun because shed_expired was set.
+    struct deadline_stats {
+        uint64_t missed { 0 };
+        uint64_t shed { 0 };
+    };
+
+    class thread_pool;
+
+    namespace detail {
+        struct pool_worker {
+            pool_worker(thread_pool* pool, std::size_t index) : pool(pool), index(index), seed(index * 2654435761u + 1) {};
+
+            std::size_t next_victim(std::size_t count) {
+                // xorshift, only used to spread thieves across victims
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                return static_cast<std::size_t>(seed % count);
+            }
+
+            thread_pool* pool;
+            std::size_t index;
+            std::size_t node { 0 };
+            int cpu { -1 };
+            uint64_t seed;
+            work_deque<task_ptr> local;
+
+            // elastic pools: written by the worker, sampled by the monitor
+            std::atomic<bool> running { false };
+            std::atomic<bool> busy { false };
+            std::atomic<uint64_t> ran { 0 };
+            std::atomic<uint32_t> blocking { 0 };
+
+            // thread_pool_options::next_slot, taken by thieves under next_lock
+            spin_lock next_lock;
+            task_ptr next;
+            std::atomic<bool> has_next { false };
+            uint32_t next_streak { 0 };
+        };
+
+        inline pool_worker*& current_worker() {
+            static thread_local pool_worker* worker = nullptr;
+            return worker;
+        }
+    }
+
     class thread_pool
     {
     public:
-        thread_pool(int thread_count = std::thread::hardware_concurrency()) : exiting_(false) {
+        thread_pool(int thread_count = std::thread::hardware_concurrency()) : thread_pool(make_options(thread_count)) {};
+        thread_pool(const thread_pool_options& options)
+        : tasks(internal_queue(options.queue)), exiting_(false)
+        , deadlines_(static_cast<std::size_t>(std::min(std::max(options.max_threads, options.thread_count), 8))), options_(options)
+        , metrics_("thread_pool", std::max(options.thread_count, 1)) {
+            // tokens taken before a cancel() stay cancelled
+            shed_token_ = shed_group_.token();
+            shed_group_.cancel();
+            spins_ = options_.idle_spins;
+            if(spins_ < 0) {
+                spins_ = std::thread::hardware_concurrency() > 1 ? 256 : 0;
+            }
+            for(std::size_t i = 0 ; i < priority_levels ; i++) {
+                if(i != lane_index(priority::normal)) {
+                    lanes_[i] = std::make_unique<task_queue>(internal_queue(options_.queue));
+                }
+                skipped_[i] = 0;
+            }
+            int thread_count = std::max(options_.thread_count, 1);
+            int max_threads = std::max(options_.max_threads, thread_count);
+            min_threads_ = static_cast<std::size_t>(thread_count);
+            elastic_ = max_threads > thread_count;
+            init_topology();
+            for(int i = 0 ; i < max_threads ; i++ ) {
+                auto worker = std::make_unique<detail::pool_worker>(this, i);
+                worker->node = i % nodes_;
+                auto& cpus = topology_[worker->node].cpus;
+                if(options_.pin_threads && !cpus.empty()) {
+                    worker->cpu = cpus[(i / nodes_) % cpus.size()];
+                }
+                workers_.push_back(std::move(worker));
+            }
+            threads_.resize(workers_.size());
             for(int i = 0 ; i < thread_count ; i++ ) {
-                threads_.push_back(std::thread(std::bind(&thread_pool::thread_func, this)));
+                start_worker(i);
+            }
+            if(elastic_) {
+                monitor_ = std::thread(std::bind(&thread_pool::monitor_func, this));
             }
         };
         ~thread_pool() {
+            stop();
+        }
+
+        // Blocks until every queue and worker deque is empty and every worker
+        // is idle, so all tasks submitted before the call have run.  Timers
+        // still waiting in runloop are not included.  Returns false if that
+        // did not happen by deadline.  Must not be called from a worker.
+        bool drain(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+            check_not_worker("thread_pool: drain from a worker");
+            bool done = drained_.wait_until([this] { return exiting_.load() || idle(); }, deadline);
+            return done && !(exiting_.load() && queued());
+        }
+
+        // Stops the workers and joins them; submissions are ignored from then
+        // on.  graceful drains first, until deadline; cancel only lets running
+        // tasks finish and drops the queued ones.  Returns true when no task
+        // was dropped.
+        bool shutdown(shutdown_mode mode = shutdown_mode::graceful, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+            check_not_worker("thread_pool: shutdown from a worker");
+            if(mode == shutdown_mode::graceful) {
+                drain(deadline);
+            }
+            stop();
+            return !queued();
+        }
+
+        void submit(detail::task_ptr&& task) {
+            metrics_.enqueue(*task);
+            auto worker = detail::current_worker();
+            if(worker && worker->pool == this) {
+                if(options_.next_slot) {
+                    task = fill_next(*worker, std::move(task));
+                    if(!task) {
+                        // lets another worker steal it should the current task block on it
+                        wake(worker->node, 1);
+                        return;
+                    }
+                }
+                if(options_.work_stealing) {
+                    worker->local.push(std::move(task));
+                    wake(worker->node, 1);
+                    return;
+                }
+            }
+            auto node = caller_node();
+            node_queue(node).add(std::move(task));
+            wake(node, 1);
+        }
+
+        void submit(priority p, detail::task_ptr&& task) {
+            if(p == priority::normal) {
+                submit(std::move(task));
+                return;
+            }
+            if(!prioritized_.load(std::memory_order_relaxed)) {
+                prioritized_.store(true);
+            }
+            metrics_.enqueue(*task);
+            lane(p).add(std::move(task));
+            wake(caller_node(), 1);
+        }
+
+        // Earliest deadline first: tasks submitted with a deadline run before
+        // the priority lanes, in deadline order (approximately, across
+        // submitting threads), and before a worker's own deque.  The deadline
+        // is kept in task->dispatch_time.
+        void submit(std::chrono::steady_clock::time_point deadline, detail::task_ptr&& task) {
+            if(!deadlined_.load(std::memory_order_relaxed)) {
+                deadlined_.store(true);
+            }
+            metrics_.enqueue(*task);
+            task->dispatch_time = deadline;
+            auto worker = detail::current_worker();
+            std::size_t hint = (worker && worker->pool == this) ? worker->index : std::hash<std::thread::id>()(std::this_thread::get_id());
+            deadlines_.push(std::move(task), hint);
+            wake(caller_node(), 1);
+        }
+
+        // Queues [first, last) with one lock acquisition and wakes no more idle
+        // workers than there are new tasks.
+        template<class It>
+        void submit_bulk(It first, It last) {
+            auto count = static_cast<std::size_t>(std::distance(first, last));
+            if(count == 0) {
+                return;
+            }
+            if(metrics_.enabled()) {
+                auto now = detail::metrics_now();
+                for(auto it = first ; it != last ; ++it) {
+                    metrics_.stamp(detail::container_of(*it), now);
+                }
+                metrics_.enqueue(count);
+            }
+            auto worker = detail::current_worker();
+            if(options_.work_stealing && worker && worker->pool == this) {
+                worker->local.push_range(first, last, [](auto&& t) { return detail::make_task_ptr(std::move(t)); });
+                wake(worker->node, count);
+            } else {
+                auto node = caller_node();
+                node_queue(node).add_range(first, last);
+                wake(node, count);
+            }
+        }
+
+        // Tasks waiting in a lane, not counting tasks held in worker deques.
+        std::size_t depth(priority p) {
+            if(p != priority::normal) {
+                return lane(p).size();
+            }
+            std::size_t res = 0;
+            for(std::size_t i = 0 ; i < nodes_ ; i++) {
+                res += node_queue(i).size();
+            }
+            return res;
+        }
+
+        // Tasks waiting for a worker among those submitted with a deadline.
+        std::size_t deadline_depth() { return deadlines_.size(); }
+
+        deadline_stats deadlines() const {
+            deadline_stats res;
+            res.missed = missed_.load(std::memory_order_relaxed);
+            res.shed = shed_.load(std::memory_order_relaxed);
+            return res;
+        }
+
+        // Nodes the workers are spread over, 1 unless numa_aware.
+        std::size_t node_count() const { return nodes_; }
+        const std::vector<numa_node>& topology() const { return topology_; }
+        std::size_t node_depth(std::size_t node) { return node_queue(node).size(); }
+
+        // Running workers; between thread_count and max_threads of the options
+        // for an elastic pool.
+        std::size_t thread_count() const { return live_.load(std::memory_order_relaxed); }
+        std::size_t max_thread_count() const { return workers_.size(); }
+
+        void set_name(const std::string& name) {
+            name_ = name;
+            metrics_.set_name(name);
+        }
+        const std::string name() const { return name_; }
+
+        // Counters of the tasks submitted to the pool.  Tasks run through
+        // run(pool, queue, ...) are counted per batch here and per task in the queue.
+        queue_metrics metrics() const {
+            auto res = metrics_.snapshot();
+            res.name = name_;
+            return res;
+        }
+        const thread_pool_options& options() const { return options_; }
+
+        task_queue tasks;
+        std::optional<run_loop> runloop;
+        
+    private:
+        friend class blocking_section;
+
+        // Shared by the destructor and shutdown(); safe to call twice.
+        void stop() {
             exiting_ = true;
+            drained_.notify_all();
+            if(monitor_.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lk(monitor_mutex_);
+                }
+                monitor_cond_.notify_all();
+                monitor_.join();
+            }
             tasks.complete = true;
-            task_waiter.notify_all();
+            for(auto & it : lanes_) {
+                if(it) {
+                    it->complete = true;
+                }
+            }
+            for(auto & it : node_queues_) {
+                if(it) {
+                    it->complete = true;
+                }
+            }
+            for(std::size_t i = 0 ; i < nodes_ ; i++) {
+                parkers_[i].notify_all();
+            }
+            {
+                // no worker is started once exiting_ is seen under the lock
+                std::lock_guard<std::mutex> lk(grow_mutex_);
+            }
             for(auto & it : threads_) {
                 if(it.joinable()) {
                     it.join();
                 }
             }
         }
-        
-        task_queue tasks;
-        std::condition_variable task_waiter;
-        std::mutex task_mutex;
-        std::optional<run_loop> runloop;
-        
-    private:
-        void thread_func() {
+
+        void check_not_worker(const char* what) {
+            auto worker = detail::current_worker();
+            if(worker && worker->pool == this) {
+                throw std::logic_error(what);
+            }
+        }
+
+        // Tasks left in any queue or deque, counted even once the pool stopped.
+        bool queued() {
+            for(auto & it : workers_) {
+                if(!it->local.empty() || it->has_next.load()) {
+                    return true;
+                }
+            }
+            for(std::size_t i = 0 ; i < priority_levels ; i++) {
+                if(depth(static_cast<priority>(i))) {
+                    return true;
+                }
+            }
+            return !deadlines_.empty();
+        }
+
+        static thread_pool_options make_options(int thread_count) {
+            thread_pool_options options;
+            options.thread_count = thread_count;
+            return options;
+        }
+
+        // The pool's own queues report through the pool's metrics.
+        static task_queue_options internal_queue(task_queue_options options) {
+            options.metrics = false;
+            return options;
+        }
+
+        static constexpr std::size_t lane_index(priority p) { return static_cast<std::size_t>(p); }
+
+        void init_topology() {
+            if(options_.numa_aware || options_.pin_threads) {
+                topology_ = options_.topology.empty() ? numa_topology() : options_.topology;
+            }
+            if(!options_.numa_aware || topology_.empty()) {
+                // one node holding every CPU
+                numa_node all { 0, {} };
+                for(auto & it : topology_) {
+                    all.cpus.insert(all.cpus.end(), it.cpus.begin(), it.cpus.end());
+                }
+                topology_.assign(1, std::move(all));
+            }
+            nodes_ = topology_.size();
+            for(std::size_t i = 0 ; i < nodes_ ; i++) {
+                node_queues_.push_back(i == 0 ? nullptr : std::make_unique<task_queue>(internal_queue(options_.queue)));
+                for(auto cpu : topology_[i].cpus) {
+                    if(cpu >= 0) {
+                        if(static_cast<std::size_t>(cpu) >= cpu_node_.size()) {
+                            cpu_node_.resize(cpu + 1, 0);
+                        }
+                        cpu_node_[cpu] = i;
+                    }
+                }
+            }
+            parkers_ = std::make_unique<detail::event_count[]>(nodes_);
+        }
+
+        task_queue& node_queue(std::size_t node) {
+            return node == 0 ? tasks : *node_queues_[node];
+        }
+
+        // Node of the submitting thread: its own node for a worker of this pool,
+        // otherwise the node of the CPU it is running on.
+        std::size_t caller_node() {
+            if(nodes_ == 1) {
+                return 0;
+            }
+            auto worker = detail::current_worker();
+            if(worker && worker->pool == this) {
+                return worker->node;
+            }
+            auto cpu = detail::current_cpu();
+            return (cpu >= 0 && static_cast<std::size_t>(cpu) < cpu_node_.size()) ? cpu_node_[cpu] : 0;
+        }
+
+        // Own node first, then the other nodes as a fallback.
+        detail::task_ptr pop_normal(std::size_t node) {
+            auto f = node_queue(node).next_pop();
+            for(std::size_t i = 1 ; i < nodes_ && !f ; i++) {
+                f = node_queue((node + i) % nodes_).next_pop();
+            }
+            return f;
+        }
+
+        detail::task_ptr pop_lane(std::size_t i, std::size_t node) {
+            return i == lane_index(priority::normal) ? pop_normal(node) : lanes_[i]->next_pop();
+        }
+
+        bool lane_has_next(std::size_t i) {
+            if(i != lane_index(priority::normal)) {
+                return lanes_[i]->has_next();
+            }
+            for(std::size_t n = 0 ; n < nodes_ ; n++) {
+                if(node_queue(n).has_next()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        task_queue& lane(priority p) {
+            return p == priority::normal ? tasks : *lanes_[lane_index(p)];
+        }
+
+        // Next task from the shared lanes: highest lane first, except that a lane
+        // passed over priority_aging times while non-empty is served next.
+        detail::task_ptr pop_shared(std::size_t node) {
+            if(!prioritized_.load(std::memory_order_relaxed)) {
+                return pop_normal(node);
+            }
+            auto aging = static_cast<uint32_t>(std::max(options_.priority_aging, 0));
+            if(aging) {
+                for(std::size_t i = priority_levels - 1 ; i > 0 ; i--) {
+                    if(skipped_[i].load(std::memory_order_relaxed) >= aging && lane_has_next(i)) {
+                        skipped_[i].store(0, std::memory_order_relaxed);
+                        auto f = pop_lane(i, node);
+                        if(f) {
+                            return f;
+                        }
+                    }
+                }
+            }
+            for(std::size_t i = 0 ; i < priority_levels ; i++) {
+                auto f = pop_lane(i, node);
+                if(f) {
+                    if(aging) {
+                        skipped_[i].store(0, std::memory_order_relaxed);
+                        for(std::size_t j = i + 1 ; j < priority_levels ; j++) {
+                            if(lane_has_next(j)) {
+                                skipped_[j].fetch_add(1, std::memory_order_relaxed);
+                            }
+                        }
+                    }
+                    return f;
+                }
+            }
+            return detail::task_ptr();
+        }
+
+        bool has_shared() {
+            if(lane_has_next(lane_index(priority::normal))) {
+                return true;
+            }
+            if(deadlined_.load() && !deadlines_.empty()) {
+                return true;
+            }
+            if(options_.next_slot) {
+                for(auto & it : workers_) {
+                    if(it->has_next.load()) {
+                        return true;
+                    }
+                }
+            }
+            if(prioritized_.load()) {
+                for(auto & it : lanes_) {
+                    if(it && it->has_next()) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        // Wakes up to count parked workers, preferring the given node.  Parked
+        // workers look at every queue, so waking one on another node is enough
+        // when the node's own workers are all busy.  waiters() still counts
+        // workers that were notified but have not run yet, so a notification
+        // can land on a node whose workers are already awake; with several
+        // nodes a worker that takes a task while more are queued passes the
+        // wake-up on, which keeps every queued task reachable.
+        void wake(std::size_t node, std::size_t count) {
+            if(elastic_ && blocked_.load(std::memory_order_relaxed)) {
+                grow();
+            }
+            if(nodes_ == 1) {
+                parkers_[0].notify(count > INT_MAX ? INT_MAX : static_cast<int>(count));
+                return;
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for(std::size_t i = 0 ; i < nodes_ && count ; i++) {
+                auto& parker = parkers_[(node + i) % nodes_];
+                std::size_t waiting = parker.waiters();
+                if(waiting) {
+                    auto n = std::min(count, waiting);
+                    parker.notify(n > INT_MAX ? INT_MAX : static_cast<int>(n));
+                    count -= n;
+                }
+            }
+        }
+
+        // Spins briefly, then parks until a submission or shutdown.  ready() is
+        // re-checked after announcing the wait so a concurrent wake is not lost.
+        // Returns false when a worker above the minimum of an elastic pool saw
+        // no wake-up for idle_timeout.
+        template<class Ready>
+        bool park(detail::pool_worker& worker, Ready&& ready) {
+            auto& parker = parkers_[worker.node];
+            for(int i = 0 ; i < spins_ ; i++) {
+                if(ready() || exiting_.load(std::memory_order_relaxed)) {
+                    return true;
+                }
+                detail::cpu_relax();
+            }
+            auto key = parker.prepare_wait();
+            if(ready() || exiting_.load()) {
+                parker.cancel_wait();
+                return true;
+            }
+            if(drained_.has_waiters()) {
+                // possibly the last worker to go idle
+                drained_.notify_all();
+            }
+            if(elastic_ && live_.load(std::memory_order_relaxed) > min_threads_) {
+                return parker.wait_for(key, options_.idle_timeout);
+            }
+            parker.wait(key);
+            return true;
+        }
+
+        void start_worker(std::size_t index) {
+            auto& worker = *workers_[index];
+            if(threads_[index].joinable()) {
+                // the slot's previous thread retired, it is past its last access
+                threads_[index].join();
+            }
+            worker.running.store(true, std::memory_order_relaxed);
+            worker.busy.store(false, std::memory_order_relaxed);
+            live_.fetch_add(1, std::memory_order_relaxed);
+            threads_[index] = std::thread(std::bind(&thread_pool::thread_func, this, &worker));
+            metrics_.set_threads(live_.load(std::memory_order_relaxed));
+        }
+
+        // Starts one more worker if the pool is below max_threads.
+        void grow() {
+            if(live_.load(std::memory_order_relaxed) >= workers_.size() || !needs_worker()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lk(grow_mutex_);
+            if(exiting_.load() || !needs_worker()) {
+                return;
+            }
+            for(std::size_t i = 0 ; i < workers_.size() ; i++) {
+                if(!workers_[i]->running.load(std::memory_order_acquire)) {
+                    start_worker(i);
+                    return;
+                }
+            }
+        }
+
+        // Tasks are waiting, no worker is parked and fewer than thread_count
+        // workers are making progress.
+        bool needs_worker() {
+            auto live = live_.load(std::memory_order_relaxed);
+            auto stuck = blocked_.load(std::memory_order_relaxed) + stalled_.load(std::memory_order_relaxed);
+            if(live >= stuck + min_threads_ || !has_work()) {
+                return false;
+            }
+            for(std::size_t i = 0 ; i < nodes_ ; i++) {
+                if(parkers_[i].waiters()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // A worker above the minimum leaves once it has timed out and there is
+        // nothing left to take.
+        bool retire() {
+            if(has_work()) {
+                return false;
+            }
+            auto live = live_.load(std::memory_order_relaxed);
+            while(live > min_threads_) {
+                if(live_.compare_exchange_weak(live, live - 1)) {
+                    metrics_.set_threads(live - 1);
+                    if(drained_.has_waiters()) {
+                        drained_.notify_all();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Samples the workers every stall_timeout: one that was busy at both
+        // samples without finishing a task is stalled.  Outside a
+        // blocking_section that is the only sign of a blocked worker.
+        void monitor_func() {
+            std::vector<uint64_t> ran(workers_.size(), 0);
+            std::vector<bool> busy(workers_.size(), false);
+            std::unique_lock<std::mutex> lk(monitor_mutex_);
+            while(!exiting_.load()) {
+                monitor_cond_.wait_for(lk, options_.stall_timeout);
+                if(exiting_.load()) {
+                    break;
+                }
+                std::size_t stalled = 0;
+                for(std::size_t i = 0 ; i < workers_.size() ; i++) {
+                    auto& worker = *workers_[i];
+                    auto now_ran = worker.ran.load(std::memory_order_relaxed);
+                    auto now_busy = worker.running.load(std::memory_order_relaxed) && worker.busy.load(std::memory_order_relaxed);
+                    if(now_busy && busy[i] && now_ran == ran[i] && !worker.blocking.load(std::memory_order_relaxed)) {
+                        stalled++;
+                    }
+                    ran[i] = now_ran;
+                    busy[i] = now_busy;
+                }
+                stalled_.store(stalled, std::memory_order_relaxed);
+                grow();
+            }
+        }
+
+        void enter_blocking(detail::pool_worker& worker) {
+            if(options_.next_slot && worker.has_next.load(std::memory_order_relaxed)) {
+                auto f = take_next(worker);
+                if(f) {
+                    requeue(worker, std::move(f));
+                }
+            }
+            auto depth = worker.blocking.load(std::memory_order_relaxed);
+            worker.blocking.store(depth + 1, std::memory_order_relaxed);
+            if(elastic_ && !depth) {
+                blocked_.fetch_add(1);
+                grow();
+            }
+        }
+
+        void leave_blocking(detail::pool_worker& worker) {
+            auto depth = worker.blocking.load(std::memory_order_relaxed) - 1;
+            worker.blocking.store(depth, std::memory_order_relaxed);
+            if(elastic_ && !depth) {
+                blocked_.fetch_sub(1);
+            }
+        }
+
+        void thread_func(detail::pool_worker* worker) {
+            detail::current_worker() = worker;
+            if(worker->cpu >= 0) {
+                detail::pin_current_thread(worker->cpu);
+            }
+            if(options_.work_stealing) {
+                steal_loop(*worker);
+            } else {
+                shared_loop(*worker);
+            }
+            detail::current_worker() = nullptr;
+            worker->running.store(false, std::memory_order_release);
+        }
+
+        // Runs a task taken from the deadline queue, or sheds it.  A shed task
+        // is run as a cancelled one, so that its hooks still release waiters.
+        void run_deadline_task(detail::pool_worker& worker, detail::task_container& task) {
+            auto deadline = task.dispatch_time;
+            if(options_.shed_expired && std::chrono::steady_clock::now() > deadline) {
+                shed_.fetch_add(1, std::memory_order_relaxed);
+                task.token = shed_token_;
+                run_task(worker, task);
+                return;
+            }
+            run_task(worker, task);
+            if(std::chrono::steady_clock::now() > deadline) {
+                missed_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void run_task(detail::pool_worker& worker, detail::task_container& task) {
+            if(elastic_) {
+                worker.busy.store(true, std::memory_order_relaxed);
+            }
+            auto started = metrics_.start(task);
+            task.run_v();
+            metrics_.finish(started);
+            if(elastic_) {
+                worker.ran.store(worker.ran.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                worker.busy.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        // Takes and runs the earliest deadline task, if any.
+        template<class More>
+        bool run_next_deadline(detail::pool_worker& worker, More&& more) {
+            if(!deadlined_.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            auto f = deadlines_.pop();
+            if(!f) {
+                return false;
+            }
+            if(nodes_ > 1 && more()) {
+                wake(worker.node, 1);
+            }
+            if(!exiting_.load()) {
+                run_deadline_task(worker, *f);
+            }
+            return true;
+        }
+
+        void shared_loop(detail::pool_worker& worker) {
             while(!exiting_.load()) {
-                std::unique_lock<std::mutex> lk(task_mutex);
-                task_waiter.wait_for(lk, std::chrono::milliseconds(100), [this]{ return tasks.has_next() || exiting_.load(); });
-                auto f = tasks.next_pop();
-                lk.unlock();
-                if(f && !exiting_.load()) {
-                    f->run_v();
+                if(run_next_deadline(worker, [this] { return has_shared(); }) || run_next_slot(worker)) {
+                    continue;
+                }
+                auto f = pop_shared(worker.node);
+                if(!f && options_.next_slot) {
+                    f = steal_next(worker);
+                }
+                if(f) {
+                    if(nodes_ > 1 && has_shared()) {
+                        wake(worker.node, 1);
+                    }
+                    if(!exiting_.load()) {
+                        run_task(worker, *f);
+                    }
+                    continue;
+                }
+                if(!park(worker, [this] { return has_shared(); }) && retire()) {
+                    return;
+                }
+            }
+        }
+
+        void steal_loop(detail::pool_worker& worker) {
+            while(!exiting_.load()) {
+                if(run_next_deadline(worker, [this] { return has_work(); }) || run_next_slot(worker)) {
+                    continue;
+                }
+                auto f = find_task(worker);
+                if(f) {
+                    if(nodes_ > 1 && has_work()) {
+                        wake(worker.node, 1);
+                    }
+                    if(!exiting_.load()) {
+                        run_task(worker, *f);
+                    }
+                    continue;
+                }
+                if(!park(worker, [this] { return has_work(); }) && retire()) {
+                    return;
+                }
+            }
+        }
+
+        detail::task_ptr find_task(detail::pool_worker& worker) {
+            detail::task_ptr f;
+            if(prioritized_.load(std::memory_order_relaxed)) {
+                f = lane(priority::high).next_pop();
+            }
+            if(!f) {
+                f = worker.local.pop();
+            }
+            if(!f) {
+                f = pop_shared(worker.node);
+            }
+            if(!f && workers_.size() > 1) {
+                // thieves try their own node before crossing to another one
+                auto count = workers_.size();
+                auto start = worker.next_victim(count);
+                for(int remote = 0 ; remote < (nodes_ > 1 ? 2 : 1) && !f ; remote++) {
+                    for(std::size_t i = 0 ; i < count && !f ; i++) {
+                        auto& victim = workers_[(start + i) % count];
+                        if(victim.get() != &worker && (nodes_ == 1 || (victim->node != worker.node) == (remote == 1))) {
+                            f = victim->local.steal();
+                        }
+                    }
+                }
+            }
+            if(!f && options_.next_slot) {
+                f = steal_next(worker);
+            }
+            return f;
+        }
+
+        // Puts task in the worker's next slot, returns the task it displaced.
+        detail::task_ptr fill_next(detail::pool_worker& worker, detail::task_ptr&& task) {
+            std::lock_guard<detail::spin_lock> lk(worker.next_lock);
+            std::swap(worker.next, task);
+            worker.has_next.store(true, std::memory_order_release);
+            return std::move(task);
+        }
+
+        detail::task_ptr take_next(detail::pool_worker& worker) {
+            std::lock_guard<detail::spin_lock> lk(worker.next_lock);
+            worker.has_next.store(false, std::memory_order_relaxed);
+            return std::move(worker.next);
+        }
+
+        detail::task_ptr steal_next(detail::pool_worker& worker) {
+            auto count = workers_.size();
+            auto start = worker.next_victim(count);
+            for(std::size_t i = 0 ; i < count ; i++) {
+                auto& victim = *workers_[(start + i) % count];
+                if(&victim != &worker && victim.has_next.load(std::memory_order_acquire)) {
+                    auto f = take_next(victim);
+                    if(f) {
+                        return f;
+                    }
                 }
             }
+            return detail::task_ptr();
         }
+
+        // Queues a task of the worker's next slot where a submission from
+        // outside the slot would have gone.
+        void requeue(detail::pool_worker& worker, detail::task_ptr&& task) {
+            if(options_.work_stealing) {
+                worker.local.push(std::move(task));
+            } else {
+                node_queue(worker.node).add(std::move(task));
+            }
+            wake(worker.node, 1);
+        }
+
+        // Runs the task left in the worker's next slot.  After next_slot_streak
+        // slot tasks in a row it is queued instead, so a chain of tasks that
+        // each submit the next cannot starve the queues.
+        bool run_next_slot(detail::pool_worker& worker) {
+            if(!worker.has_next.load(std::memory_order_relaxed)) {
+                worker.next_streak = 0;
+                return false;
+            }
+            auto f = take_next(worker);
+            if(!f) {
+                worker.next_streak = 0;
+                return false;
+            }
+            if(++worker.next_streak > next_slot_streak) {
+                worker.next_streak = 0;
+                requeue(worker, std::move(f));
+                return false;
+            }
+            if(!exiting_.load()) {
+                run_task(worker, *f);
+            }
+            return true;
+        }
+
+        // Nothing queued and every live worker parked.  A worker counts as
+        // parked from prepare_wait() until it has woken up, and it is awake
+        // before it takes a task, so a task taken after has_work() looked
+        // keeps its worker out of the count.
+        bool idle() {
+            if(has_work()) {
+                return false;
+            }
+            std::size_t parked = 0;
+            for(std::size_t i = 0 ; i < nodes_ ; i++) {
+                parked += parkers_[i].waiters();
+            }
+            return parked >= live_.load();
+        }
+
+        bool has_work() {
+            if(has_shared()) {
+                return true;
+            }
+            for(auto & it : workers_) {
+                if(!it->local.empty()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static constexpr uint32_t next_slot_streak = 3;
+
         std::atomic<bool> exiting_;
-        std::list<std::thread> threads_;
+        std::vector<numa_node> topology_;
+        std::size_t nodes_ { 1 };
+        std::vector<std::unique_ptr<task_queue>> node_queues_; // node 0 is `tasks`
+        std::vector<std::size_t> cpu_node_;
+        std::unique_ptr<detail::event_count[]> parkers_;
+        std::array<std::unique_ptr<task_queue>, priority_levels> lanes_; // normal is `tasks`
+        std::array<std::atomic<uint32_t>, priority_levels> skipped_;
+        std::atomic<bool> prioritized_ { false };
+        detail::deadline_queue deadlines_;
+        std::atomic<bool> deadlined_ { false };
+        std::atomic<uint64_t> missed_ { 0 };
+        std::atomic<uint64_t> shed_ { 0 };
+        cancel_group shed_group_;
+        cancel_token shed_token_;
+        int spins_;
+        thread_pool_options options_;
+        detail::metrics_source metrics_;
+        std::string name_ { "thread_pool" };
+        std::vector<std::unique_ptr<detail::pool_worker>> workers_; // max_threads slots
+        std::vector<std::thread> threads_;
+        std::atomic<std::size_t> live_ { 0 };
+        std::size_t min_threads_ { 1 };
+        bool elastic_ { false };
+        std::atomic<std::size_t> blocked_ { 0 };
+        std::atomic<std::size_t> stalled_ { 0 };
+        std::mutex grow_mutex_;
+        std::mutex monitor_mutex_;
+        std::condition_variable monitor_cond_;
+        std::thread monitor_;
+        detail::event_count drained_;
+    };
+
+    // Marks the calling pool worker as blocked (on I/O, a lock, a future...)
+    // for the guard's lifetime.  An elastic pool with tasks waiting starts a
+    // replacement worker right away instead of waiting for stall_timeout.
+    // Does nothing outside a pool worker or in a fixed-size pool.
+    class blocking_section {
+    public:
+        blocking_section() : worker_(detail::current_worker()) {
+            if(worker_) {
+                worker_->pool->enter_blocking(*worker_);
+            }
+        }
+        blocking_section(const blocking_section& other) = delete;
+        blocking_section& operator=(const blocking_section& other) = delete;
+
+        ~blocking_section() {
+            if(worker_) {
+                worker_->pool->leave_blocking(*worker_);
+            }
+        }
+
+    private:
+        detail::pool_worker* worker_;
     };
     
 }
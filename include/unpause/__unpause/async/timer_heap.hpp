@@ -0,0 +1,147 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_TIMER_HEAP_HPP
+#define UNPAUSE_ASYNC_TIMER_HEAP_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // 4-ary min-heap keyed by deadline.  Values live in chunked slot storage
+        // that is never reordered or reallocated, the heap itself only moves small
+        // (deadline, sequence, slot) entries around.  Equal deadlines pop in insertion order.
+        // push/pop are O(log n), top() is O(1).
+        template<class T, class Clock = std::chrono::steady_clock>
+        class timer_heap {
+        public:
+            using time_point = typename Clock::time_point;
+
+            timer_heap() : slot_count_(0), sequence_(0) {};
+            timer_heap(const timer_heap& other) = delete;
+            timer_heap& operator=(const timer_heap& other) = delete;
+
+            void push(time_point deadline, T&& value) {
+                std::size_t slot;
+                if(free_.empty()) {
+                    slot = slot_count_++;
+                    if((slot >> chunk_shift) == chunks_.size()) {
+                        chunks_.push_back(std::make_unique<T[]>(chunk_size));
+                    }
+                } else {
+                    slot = free_.back();
+                    free_.pop_back();
+                }
+                value_at(slot) = std::move(value);
+                entries_.push_back(entry { deadline, sequence_++, slot });
+                sift_up(entries_.size() - 1);
+            }
+
+            T pop() {
+                T value = std::move(value_at(entries_.front().slot));
+                free_.push_back(entries_.front().slot);
+                entries_.front() = entries_.back();
+                entries_.pop_back();
+                if(!entries_.empty()) {
+                    sift_down(0);
+                }
+                return value;
+            }
+
+            time_point top_deadline() const { return entries_.front().deadline; }
+            T& top() { return value_at(entries_.front().slot); }
+
+            bool empty() const { return entries_.empty(); }
+            std::size_t size() const { return entries_.size(); }
+
+            void reserve(std::size_t n) {
+                entries_.reserve(n);
+            }
+
+            void clear() {
+                entries_.clear();
+                chunks_.clear();
+                free_.clear();
+                slot_count_ = 0;
+            }
+
+        private:
+            static constexpr std::size_t arity = 4;
+            static constexpr std::size_t chunk_shift = 8;
+            static constexpr std::size_t chunk_size = std::size_t(1) << chunk_shift;
+
+            T& value_at(std::size_t slot) { return chunks_[slot >> chunk_shift][slot & (chunk_size - 1)]; }
+
+            struct entry {
+                time_point deadline;
+                uint64_t sequence;
+                std::size_t slot;
+
+                bool operator<(const entry& rhs) const {
+                    return deadline < rhs.deadline || (deadline == rhs.deadline && sequence < rhs.sequence);
+                }
+            };
+
+            void sift_up(std::size_t i) {
+                entry e = entries_[i];
+                while(i > 0) {
+                    std::size_t parent = (i - 1) / arity;
+                    if(!(e < entries_[parent])) {
+                        break;
+                    }
+                    entries_[i] = entries_[parent];
+                    i = parent;
+                }
+                entries_[i] = e;
+            }
+
+            void sift_down(std::size_t i) {
+                entry e = entries_[i];
+                std::size_t n = entries_.size();
+                for(;;) {
+                    std::size_t first = i * arity + 1;
+                    if(first >= n) {
+                        break;
+                    }
+                    std::size_t last = std::min(first + arity, n);
+                    std::size_t best = first;
+                    for(std::size_t c = first + 1 ; c < last ; c++) {
+                        if(entries_[c] < entries_[best]) {
+                            best = c;
+                        }
+                    }
+                    if(!(entries_[best] < e)) {
+                        break;
+                    }
+                    entries_[i] = entries_[best];
+                    i = best;
+                }
+                entries_[i] = e;
+            }
+
+            std::vector<entry> entries_;
+            std::vector<std::unique_ptr<T[]>> chunks_;
+            std::vector<std::size_t> free_;
+            std::size_t slot_count_;
+            uint64_t sequence_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_TIMER_HEAP_HPP */
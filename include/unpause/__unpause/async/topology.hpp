@@ -0,0 +1,146 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_TOPOLOGY_HPP
+#define UNPAUSE_ASYNC_TOPOLOGY_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+namespace unpause { namespace async {
+
+    struct numa_node {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    namespace detail {
+
+        // Parses a kernel cpu list such as "0-3,8,10-11".
+        inline std::vector<int> parse_cpu_list(const std::string& list) {
+            std::vector<int> cpus;
+            std::size_t pos = 0;
+            while(pos < list.size()) {
+                auto end = list.find(',', pos);
+                if(end == std::string::npos) {
+                    end = list.size();
+                }
+                auto item = list.substr(pos, end - pos);
+                auto dash = item.find('-');
+                char* tail = nullptr;
+                long first = std::strtol(item.c_str(), &tail, 10);
+                if(tail != item.c_str()) {
+                    long last = dash == std::string::npos ? first : std::strtol(item.c_str() + dash + 1, nullptr, 10);
+                    for(long c = first ; c <= last ; c++) {
+                        cpus.push_back(static_cast<int>(c));
+                    }
+                }
+                pos = end + 1;
+            }
+            return cpus;
+        }
+
+        inline bool cpu_allowed(int cpu) {
+#if defined(__linux__)
+            static const cpu_set_t allowed = [] {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                if(sched_getaffinity(0, sizeof(set), &set) != 0) {
+                    for(int i = 0 ; i < CPU_SETSIZE ; i++) {
+                        CPU_SET(i, &set);
+                    }
+                }
+                return set;
+            }();
+            return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed);
+#else
+            return cpu >= 0;
+#endif
+        }
+
+        inline bool pin_current_thread(int cpu) {
+#if defined(__linux__)
+            if(cpu < 0 || cpu >= CPU_SETSIZE) {
+                return false;
+            }
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+            (void)cpu;
+            return false;
+#endif
+        }
+
+        inline int current_cpu() {
+#if defined(__linux__)
+            return sched_getcpu();
+#else
+            return -1;
+#endif
+        }
+    }
+
+    // NUMA nodes and their CPUs, restricted to the CPUs this process may run
+    // on.  Read from /sys/devices/system/node on Linux; elsewhere, or if that
+    // fails, a single node holding every CPU.
+    inline std::vector<numa_node> numa_topology() {
+        std::vector<numa_node> nodes;
+#if defined(__linux__)
+        if(auto dir = opendir("/sys/devices/system/node")) {
+            while(auto entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if(name.size() <= 4 || name.compare(0, 4, "node") || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+                    continue;
+                }
+                std::ifstream in("/sys/devices/system/node/" + name + "/cpulist");
+                std::string list;
+                std::getline(in, list);
+                numa_node node { std::atoi(name.c_str() + 4), {} };
+                for(auto cpu : detail::parse_cpu_list(list)) {
+                    if(detail::cpu_allowed(cpu)) {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                if(!node.cpus.empty()) {
+                    nodes.push_back(std::move(node));
+                }
+            }
+            closedir(dir);
+        }
+#endif
+        if(nodes.empty()) {
+            numa_node node { 0, {} };
+            int count = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+            for(int cpu = 0 ; cpu < count ; cpu++) {
+                if(detail::cpu_allowed(cpu)) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            nodes.push_back(std::move(node));
+        }
+        std::sort(nodes.begin(), nodes.end(), [](const numa_node& lhs, const numa_node& rhs) { return lhs.id < rhs.id; });
+        return nodes;
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_TOPOLOGY_HPP */
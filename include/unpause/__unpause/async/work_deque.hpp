@@ -0,0 +1,97 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef UNPAUSE_ASYNC_WORK_DEQUE_HPP
+#define UNPAUSE_ASYNC_WORK_DEQUE_HPP
+
+#include <unpause/__unpause/async/spin_lock.hpp>
+#include <unpause/__unpause/async/ring_buffer.hpp>
+
+#include <cstddef>
+#include <utility>
+#include <atomic>
+#include <mutex>
+
+namespace unpause { namespace async {
+
+    namespace detail {
+
+        // Per-worker deque.  The owning worker pushes and pops at the back (LIFO),
+        // other workers steal from the front (FIFO).  Each deque has its own lock
+        // so the only contention is between an owner and a thief on the same deque.
+        template<class T>
+        class work_deque {
+        public:
+            work_deque(std::size_t capacity = 64) : slots_(capacity), size_(0) {};
+            work_deque(const work_deque& other) = delete;
+            work_deque& operator=(const work_deque& other) = delete;
+
+            void push(T&& value) {
+                std::lock_guard<spin_lock> lk(lock_);
+                slots_.push_back(std::move(value));
+                size_.store(slots_.size(), std::memory_order_release);
+            }
+
+            template<class It, class Convert>
+            void push_range(It first, It last, Convert convert) {
+                std::lock_guard<spin_lock> lk(lock_);
+                for(; first != last ; ++first) {
+                    slots_.push_back(convert(std::move(*first)));
+                }
+                size_.store(slots_.size(), std::memory_order_release);
+            }
+
+            // owner side
+            T pop() {
+                if(empty()) {
+                    return T();
+                }
+                std::lock_guard<spin_lock> lk(lock_);
+                if(slots_.empty()) {
+                    return T();
+                }
+                T value = slots_.pop_back();
+                size_.store(slots_.size(), std::memory_order_release);
+                return value;
+            }
+
+            // thief side
+            T steal() {
+                if(empty() || !lock_.try_lock()) {
+                    return T();
+                }
+                std::lock_guard<spin_lock> lk(lock_, std::adopt_lock);
+                if(slots_.empty()) {
+                    return T();
+                }
+                T value = slots_.pop_front();
+                size_.store(slots_.size(), std::memory_order_release);
+                return value;
+            }
+
+            bool empty() const { return size_.load(std::memory_order_acquire) == 0; }
+            std::size_t size() const { return size_.load(std::memory_order_acquire); }
+
+            void clear() {
+                std::lock_guard<spin_lock> lk(lock_);
+                slots_.clear();
+                size_.store(0, std::memory_order_release);
+            }
+
+        private:
+            ring_buffer<T> slots_;
+            alignas(cache_line_size) std::atomic<std::size_t> size_;
+            spin_lock lock_;
+        };
+    }
+}
+}
+
+#endif /* UNPAUSE_ASYNC_WORK_DEQUE_HPP */
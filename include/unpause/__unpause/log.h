@@ -21,46 +21,82 @@
 #include <string.h>
 #include <chrono>
 
-static inline const std::string currentDateTime()
+// Formatted local time, rebuilt at most once per second on each thread.
+static inline const char* currentDateTimeStr()
 {
+    static thread_local time_t cached = -1;
+    static thread_local char   buf[80];
     time_t     now = time(0);
-    struct tm  tstruct;
-    char       buf[80];
-	tstruct = *localtime(&now);
 
-    // Visit http://en.cppreference.com/w/cpp/chrono/c/strftime
-    // for more information about date/time format
-    strftime(buf, sizeof(buf), "%Y-%m-%d %X", &tstruct);
+    if(now != cached) {
+        struct tm  tstruct;
+        localtime_r(&now, &tstruct);
 
+        // Visit http://en.cppreference.com/w/cpp/chrono/c/strftime
+        // for more information about date/time format
+        strftime(buf, sizeof(buf), "%Y-%m-%d %X", &tstruct);
+        cached = now;
+    }
     return buf;
 }
 
+static inline const std::string currentDateTime()
+{
+    return currentDateTimeStr();
+}
+
 #ifndef COMMERCIAL
-#define LOG_STR(fmt, ...) "[%s] [%s:%4d] " fmt "\n", currentDateTime().c_str(), __BASE_FILE__, __LINE__, ##__VA_ARGS__
+#define LOG_STR(fmt, ...) "[%s] [%s:%4d] " fmt "\n", currentDateTimeStr(), __BASE_FILE__, __LINE__, ##__VA_ARGS__
 #else
-#define LOG_STR(fmt, ...) "[%s] " fmt "\n", currentDateTime().c_str(), ##__VA_ARGS__
+#define LOG_STR(fmt, ...) "[%s] " fmt "\n", currentDateTimeStr(), ##__VA_ARGS__
+#endif
+
+#ifdef UNPAUSE_LOG_ASYNC
+#include "log_async.h"
+
+#ifndef COMMERCIAL
+#define LOG_ASYNC(lvl, fmt, ...) ::unpause::log::detail::write(lvl "[%s] [%s:%4d] " fmt "\n", __BASE_FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define LOG_ASYNC(lvl, fmt, ...) ::unpause::log::detail::write(lvl "[%s] " fmt "\n", ##__VA_ARGS__)
+#endif
 #endif
 
 #if LOG_LEVEL >= 0
+#ifdef UNPAUSE_LOG_ASYNC
+#define DFatal(fmt, ...) LOG_ASYNC("[F]", fmt, ##__VA_ARGS__); ::unpause::log::flush();
+#else
 #define DFatal(fmt, ...) fprintf(stderr, "[F]" LOG_STR(fmt, ##__VA_ARGS__)); fflush(stderr);
+#endif
 #else
 #define DFatal(fmt, ...) {}
 #endif
 
 #if LOG_LEVEL >= 1
+#ifdef UNPAUSE_LOG_ASYNC
+#define DErr(fmt, ...) LOG_ASYNC("[E]", fmt, ##__VA_ARGS__);
+#else
 #define DErr(fmt, ...) fprintf(stderr,   "[E]" LOG_STR(fmt, ##__VA_ARGS__)); fflush(stderr);
+#endif
 #else
 #define DErr(fmt, ...) {}
 #endif
 
 #if LOG_LEVEL >= 2
+#ifdef UNPAUSE_LOG_ASYNC
+#define DInfo(fmt, ...) LOG_ASYNC("[I]", fmt, ##__VA_ARGS__);
+#else
 #define DInfo(fmt, ...) fprintf(stderr,  "[I]" LOG_STR(fmt, ##__VA_ARGS__)); fflush(stderr);
+#endif
 #else
 #define DInfo(fmt, ...) {}
 #endif
 
 #if LOG_LEVEL >= 3
+#ifdef UNPAUSE_LOG_ASYNC
+#define DDbg(fmt, ...) LOG_ASYNC("[D]", fmt, ##__VA_ARGS__);
+#else
 #define DDbg(fmt, ...) fprintf(stderr,   "[D]" LOG_STR(fmt, ##__VA_ARGS__)); fflush(stderr);
+#endif
 #else
 #define DDbg(fmt, ...) {}
 #endif
@@ -0,0 +1,380 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+#ifndef __unpause_tools_log_async_h
+#define __unpause_tools_log_async_h
+
+// Asynchronous backend for the log.h macros, enabled with UNPAUSE_LOG_ASYNC.
+//
+// The calling thread copies the format string pointer, a coarse timestamp and
+// the raw arguments (C strings are copied by value) into its own single
+// producer ring buffer.  A background thread drains every ring, formats the
+// records and writes them to stderr in batches.  The formatted timestamp is
+// cached and only rebuilt when the second changes.  The writer sleeps while
+// every ring is empty; the first record committed after that wakes it.
+
+#include <condition_variable>
+#include <type_traits>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <tuple>
+#include <ctime>
+#include <stdarg.h>
+#include <stdio.h>
+
+#ifndef UNPAUSE_LOG_BUFFER_SIZE
+#define UNPAUSE_LOG_BUFFER_SIZE (64 * 1024)
+#endif
+
+// Marks a printf-style format parameter.  The arguments travel as a template
+// pack, so only the format string itself is checked (first argument 0), and
+// a format checked this way may be handed on without -Wformat-nonliteral.
+#if defined(__GNUC__)
+#define UNPAUSE_LOG_FORMAT(index) __attribute__((format(printf, index, 0)))
+#else
+#define UNPAUSE_LOG_FORMAT(index)
+#endif
+
+namespace unpause { namespace log {
+
+    namespace detail {
+
+        // Single producer / single consumer byte ring holding variable size records.
+        class record_ring {
+        public:
+            static constexpr std::size_t capacity = UNPAUSE_LOG_BUFFER_SIZE;
+
+            record_ring() : head_(0), tail_(0), retired(false) {};
+
+            // Producer: returns space for size bytes or nullptr when full.
+            unsigned char* reserve(std::size_t size) {
+                auto tail = tail_.load(std::memory_order_relaxed);
+                auto head = head_.load(std::memory_order_acquire);
+                auto offset = tail % capacity;
+                std::size_t pad = (offset + size > capacity) ? capacity - offset : 0;
+                if(tail + pad + size - head > capacity) {
+                    return nullptr;
+                }
+                pending_pad_ = pad;
+                if(pad) {
+                    // a record that does not fit at the end starts again at the front,
+                    // a zero size tells the consumer to skip the rest of the buffer
+                    std::size_t skip = 0;
+                    std::memcpy(buffer_ + offset, &skip, sizeof(skip));
+                    offset = 0;
+                }
+                return buffer_ + offset;
+            }
+
+            void commit(std::size_t size) {
+                tail_.store(tail_.load(std::memory_order_relaxed) + pending_pad_ + size, std::memory_order_release);
+            }
+
+            // Consumer: calls f(record) for every committed record.
+            template<class F>
+            bool drain(F&& f) {
+                auto head = head_.load(std::memory_order_relaxed);
+                auto tail = tail_.load(std::memory_order_acquire);
+                if(head == tail) {
+                    return false;
+                }
+                while(head != tail) {
+                    auto offset = head % capacity;
+                    std::size_t size;
+                    std::memcpy(&size, buffer_ + offset, sizeof(size));
+                    if(size == 0) {
+                        head += capacity - offset;
+                        continue;
+                    }
+                    f(buffer_ + offset);
+                    head += size;
+                }
+                head_.store(head, std::memory_order_release);
+                return true;
+            }
+
+            bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+        private:
+            alignas(64) std::atomic<std::size_t> head_;
+            alignas(64) std::atomic<std::size_t> tail_;
+            std::size_t pending_pad_ { 0 };
+            alignas(16) unsigned char buffer_[capacity];
+
+        public:
+            std::atomic<bool> retired;
+        };
+
+        // C strings are copied into the record, everything else by value.
+        template<class T>
+        using is_c_string = std::integral_constant<bool, std::is_same<std::decay_t<T>, char*>::value || std::is_same<std::decay_t<T>, const char*>::value>;
+
+        template<class T>
+        using stored_t = std::conditional_t<is_c_string<T>::value, const char*, std::decay_t<T>>;
+
+        inline std::size_t align8(std::size_t v) { return (v + 7) & ~std::size_t(7); }
+
+        template<class T>
+        std::size_t arg_size(const T& v) {
+            if constexpr (is_c_string<T>::value) {
+                const char* s = v;
+                return align8((s ? std::strlen(s) : 6) + 1);
+            } else {
+                return align8(sizeof(std::decay_t<T>));
+            }
+        }
+
+        template<class T>
+        unsigned char* write_arg(unsigned char* p, const T& v) {
+            if constexpr (is_c_string<T>::value) {
+                const char* s = v;
+                s = s ? s : "(null)";
+                auto n = std::strlen(s) + 1;
+                std::memcpy(p, s, n);
+                return p + align8(n);
+            } else {
+                static_assert(std::is_trivially_copyable<std::decay_t<T>>::value, "log arguments are copied into the ring byte by byte");
+                std::decay_t<T> copy = v;
+                std::memcpy(p, &copy, sizeof(copy));
+                return p + align8(sizeof(copy));
+            }
+        }
+
+        template<class T>
+        stored_t<T> read_arg(const unsigned char*& p) {
+            if constexpr (is_c_string<T>::value) {
+                const char* s = reinterpret_cast<const char*>(p);
+                p += align8(std::strlen(s) + 1);
+                return s;
+            } else {
+                std::decay_t<T> v;
+                std::memcpy(&v, p, sizeof(v));
+                p += align8(sizeof(v));
+                return v;
+            }
+        }
+
+        struct record_header {
+            std::size_t size;
+            void (*format)(FILE* out, const char* timestamp, const char* fmt, const unsigned char* payload);
+            const char* fmt;
+            time_t seconds;
+        };
+
+        // fprintf for a format that was checked where it was logged.
+        UNPAUSE_LOG_FORMAT(2)
+        inline int print_record(FILE* out, const char* fmt, ...) {
+            va_list args;
+            va_start(args, fmt);
+            int res = vfprintf(out, fmt, args);
+            va_end(args);
+            return res;
+        }
+
+        template<class... Args>
+        UNPAUSE_LOG_FORMAT(3)
+        void format_record(FILE* out, const char* timestamp, const char* fmt, const unsigned char* payload) {
+            std::tuple<stored_t<Args>...> args { read_arg<Args>(payload)... };
+            std::apply([&](auto... a) { print_record(out, fmt, timestamp, a...); }, args);
+        }
+
+        inline time_t coarse_seconds() {
+#if defined(CLOCK_REALTIME_COARSE)
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            return ts.tv_sec;
+#else
+            return time(0);
+#endif
+        }
+
+        class logger {
+        public:
+            static logger& instance() {
+                static logger l;
+                return l;
+            }
+
+            logger() : sleeping_(false), exiting_(false), requested_(0), completed_(0), cached_seconds_(-1), writer_(&logger::loop, this) {};
+            ~logger() {
+                {
+                    std::lock_guard<std::mutex> lk(mutex_);
+                    exiting_ = true;
+                }
+                cond_.notify_all();
+                if(writer_.joinable()) {
+                    writer_.join();
+                }
+            }
+
+            std::shared_ptr<record_ring> attach() {
+                auto ring = std::make_shared<record_ring>();
+                std::lock_guard<std::mutex> lk(mutex_);
+                rings_.push_back(ring);
+                return ring;
+            }
+
+            // Called by producers after committing a record: wakes the writer
+            // if it went to sleep, which costs a fence when it is awake.
+            void committed() {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(sleeping_.load(std::memory_order_relaxed)) {
+                    wake();
+                }
+            }
+
+            void wake() {
+                {
+                    std::lock_guard<std::mutex> lk(mutex_);
+                    sleeping_.store(false, std::memory_order_relaxed);
+                }
+                cond_.notify_one();
+            }
+
+            // Blocks until everything logged before the call has been written.
+            void flush() {
+                std::unique_lock<std::mutex> lk(mutex_);
+                auto ticket = ++requested_;
+                cond_.notify_all();
+                done_.wait(lk, [&] { return completed_ >= ticket || exiting_; });
+            }
+
+        private:
+            void loop() {
+                std::vector<std::shared_ptr<record_ring>> rings;
+                for(;;) {
+                    uint64_t ticket = 0;
+                    bool exiting = false;
+                    {
+                        std::unique_lock<std::mutex> lk(mutex_);
+                        if(!exiting_ && requested_ == completed_) {
+                            // a producer either sees sleeping_ or its record is seen here
+                            sleeping_.store(true, std::memory_order_relaxed);
+                            std::atomic_thread_fence(std::memory_order_seq_cst);
+                            if(std::all_of(rings_.begin(), rings_.end(), [](const std::shared_ptr<record_ring>& r) { return r->empty(); })) {
+                                cond_.wait(lk, [this] { return !sleeping_.load(std::memory_order_relaxed) || exiting_ || requested_ > completed_; });
+                            }
+                            sleeping_.store(false, std::memory_order_relaxed);
+                        }
+                        rings = rings_;
+                        ticket = requested_;
+                        exiting = exiting_;
+                    }
+                    bool wrote = false;
+                    for(auto & ring : rings) {
+                        wrote |= ring->drain([this](const unsigned char* record) {
+                            auto header = reinterpret_cast<const record_header*>(record);
+                            header->format(stderr, timestamp(header->seconds), header->fmt, record + sizeof(record_header));
+                        });
+                    }
+                    if(wrote) {
+                        fflush(stderr);
+                    }
+                    {
+                        std::lock_guard<std::mutex> lk(mutex_);
+                        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<record_ring>& r) {
+                            return r->retired.load() && r->empty();
+                        }), rings_.end());
+                        completed_ = ticket;
+                    }
+                    done_.notify_all();
+                    if(exiting) {
+                        break;
+                    }
+                }
+            }
+
+            const char* timestamp(time_t seconds) {
+                if(seconds != cached_seconds_) {
+                    struct tm tstruct;
+                    localtime_r(&seconds, &tstruct);
+                    strftime(cached_, sizeof(cached_), "%Y-%m-%d %X", &tstruct);
+                    cached_seconds_ = seconds;
+                }
+                return cached_;
+            }
+
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::condition_variable done_;
+            std::vector<std::shared_ptr<record_ring>> rings_;
+            std::atomic<bool> sleeping_;
+            bool exiting_;
+            uint64_t requested_;
+            uint64_t completed_;
+            time_t cached_seconds_;
+            char cached_[80];
+            std::thread writer_;
+        };
+
+        struct thread_ring {
+            thread_ring() : ring(logger::instance().attach()) {};
+            ~thread_ring() { ring->retired = true; }
+            std::shared_ptr<record_ring> ring;
+        };
+
+        inline record_ring& local_ring() {
+            static thread_local thread_ring local;
+            return *local.ring;
+        }
+
+        template<class... Args>
+        UNPAUSE_LOG_FORMAT(1)
+        void write(const char* fmt, const Args&... args) {
+            std::size_t size = sizeof(record_header);
+            ((size += arg_size(args)), ...);
+            size = align8(size);
+            if(size > record_ring::capacity / 2) {
+                // too large to queue, write it in place once the earlier records are out
+                logger::instance().flush();
+                time_t now = coarse_seconds();
+                struct tm tstruct;
+                char timestamp[80];
+                localtime_r(&now, &tstruct);
+                strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %X", &tstruct);
+                print_record(stderr, fmt, timestamp, static_cast<stored_t<Args>>(args)...);
+                fflush(stderr);
+                return;
+            }
+            auto& ring = local_ring();
+            unsigned char* p = nullptr;
+            while(!(p = ring.reserve(size))) {
+                // full: let the writer catch up
+                logger::instance().wake();
+                std::this_thread::yield();
+            }
+            auto header = reinterpret_cast<record_header*>(p);
+            header->size = size;
+            header->format = &format_record<Args...>;
+            header->fmt = fmt;
+            header->seconds = coarse_seconds();
+            p += sizeof(record_header);
+            ((p = write_arg(p, args)), ...);
+            ring.commit(size);
+            logger::instance().committed();
+        }
+    }
+
+    // Blocks until all records logged so far have been written.
+    inline void flush() {
+        detail::logger::instance().flush();
+    }
+}
+}
+
+#endif
@@ -10,12 +10,21 @@
 
 
 #include <iostream>
+#include <algorithm>
+#include <numeric>
 #include <random>
 #include <atomic>
+#include <array>
+#include <vector>
+#include <thread>
+#include <string>
+#include <stdexcept>
 
 #include <stdio.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 static std::atomic<int> s_order(0);
 
@@ -28,6 +37,15 @@ static int order() { return s_order.fetch_add(1); }
 
 static const uint64_t iterations = 500000;
 
+// Multiplies res by 5 before and after the task it is linked to.
+struct scale_hook : public unpause::async::detail::task_hook {
+    explicit scale_hook(int& res) : res(res) {
+        before = [](unpause::async::detail::task_hook& hook) { static_cast<scale_hook&>(hook).res *= 5; };
+        after = before;
+    }
+    int& res;
+};
+
 void task_test() {
     log("------- Testing async::task -------");
     using namespace unpause;
@@ -72,30 +90,207 @@ void task_test() {
     }
     log("------- Testing async::detail::task_container -------");
     {
-        log("before_internal and after_internal");
+        log("hooks run around the task and after");
         int res = 1;
+        scale_hook hook(res);
         auto t = async::make_task([](int& val) { return ++val; }, res); // res should = 6 at this point.
         t.after = [&] (int ret) { res += ret; }; // res should = 12
-        t.before_internal = [&] { res = res * 5; }; // res should = 5 at this point
-        t.after_internal = [&] { res = res * 5; }; // res should = 60 at this point.
+        t.link(hook); // res should = 5 before the task and 60 after it.
         t();
         log_v("res=%d", res);
         assert(res == 60);
         log("OK");
     }
     {
-        log("before_internal and after_internal with move");
+        log("hooks run around the task and after with move");
         int res = 1;
+        scale_hook hook(res);
         auto t = async::make_task([](int& val) { return ++val; }, res); // res should = 6 at this point.
         t.after = [&] (int ret) { res += ret; }; // res should = 12
-        t.before_internal = [&] { res = res * 5; }; // res should = 5 at this point
-        t.after_internal = [&] { res = res * 5; }; // res should = 60 at this point.
+        t.link(hook); // res should = 5 before the task and 60 after it.
         auto t2 = std::move(t);
         t2();
         log_v("res=%d", res);
         assert(res == 60);
         log("OK");
     }
+    {
+        log("static_task calls its callable and after directly");
+        int res = 0;
+        auto t = async::make_static_task([](int a, int b) { return a + b; }, 2, 3).then([&res](int r) { res = r * 2; });
+        auto plain = async::make_task([](int a, int b) { return a + b; }, 2, 3);
+        log_v("static_task %d bytes, task %d bytes", (int)sizeof(t), (int)sizeof(plain));
+        assert(sizeof(t) < sizeof(plain));
+        assert(t() == 5 && res == 10);
+
+        // hooks run around the task, even when it is cancelled
+        struct counting_hook : async::detail::task_hook {
+            int before_ct = 0;
+            int after_ct = 0;
+        };
+        counting_hook hook;
+        hook.before = [](async::detail::task_hook& h) { static_cast<counting_hook&>(h).before_ct++; };
+        hook.after = [](async::detail::task_hook& h) { static_cast<counting_hook&>(h).after_ct++; };
+        int ct = 0;
+        auto counted = async::make_static_task([&ct] { ++ct; });
+        counted.link(hook);
+        auto moved = std::move(counted);
+        moved();
+        assert(ct == 1 && hook.before_ct == 1 && hook.after_ct == 1);
+        async::cancel_group group;
+        auto skipped = async::make_static_task([&ct] { ++ct; });
+        skipped.token = group.token();
+        group.cancel();
+        skipped.link(hook);
+        skipped();
+        assert(ct == 1 && hook.before_ct == 2 && hook.after_ct == 2);
+
+        // queues and pools take them like tasks
+        async::thread_pool pool(2);
+        async::task_queue queue;
+        std::atomic<int> sum(0);
+        auto add = [&sum](int v) { sum += v; };
+        auto a = async::make_static_task(add, 1);
+        async::run(pool, a);
+        auto b = async::make_static_task(add, 10);
+        async::run(pool, queue, b);
+        auto c = async::make_static_task(add, 100).then([&sum] { sum += 1000; });
+        async::run_sync(pool, c);
+        auto d = async::make_static_task(add, 10000);
+        async::run_sync(pool, queue, d);
+        assert(pool.drain());
+        auto e = async::make_static_task(add, 100000);
+        queue.add(e);
+        while(queue.next());
+        log_v("sum=%d", sum.load());
+        assert(sum == 111111);
+        log("OK");
+    }
+    log("------- Testing async::detail::task_ptr -------");
+    {
+        log("small tasks are stored inline, large ones on the heap");
+        uint64_t val = 0;
+        auto small = [&](uint64_t in) { val += in; };
+        static_assert(async::detail::task_ptr::stored_inline<async::task<decltype(small), uint64_t>>(), "typical task should fit inline");
+        uint64_t w1 = 0, w2 = 0, w3 = 0, w4 = 0;
+        auto wide = [&val, &w1, &w2, &w3, &w4] { val += w1 + w2 + w3 + w4; };
+        static_assert(sizeof(wide) == 5 * sizeof(void*), "five captured references");
+#if !defined(UNPAUSE_ASYNC_METRICS) // queued_at takes 8 of the bytes
+        static_assert(async::detail::task_ptr::stored_inline<async::task<decltype(wide)>>(), "the callable is part of the inline task, not a separate allocation");
+#endif
+        auto p = async::detail::task_ptr::make<async::task<decltype(small), uint64_t>>(std::move(small), (uint64_t)2);
+        assert(p.is_inline());
+        auto p2 = std::move(p);
+        assert(!p && p2.is_inline());
+        p2->run_v();
+
+        std::array<uint64_t, 64> big;
+        big.fill(1);
+        auto large = [&val](const std::array<uint64_t, 64>& in) { for(auto & it : in) { val += it; } };
+        auto p3 = async::detail::task_ptr::make<async::task<decltype(large), std::array<uint64_t, 64>>>(std::move(large), std::move(big));
+        assert(p3 && !p3.is_inline());
+        p3->run_v();
+        log_v("val=%" PRId64, val);
+        assert(val == 66);
+        log("OK");
+    }
+#if UNPAUSE_ASYNC_TASK_POOL
+    {
+        log("large tasks come from per-thread pools and their memory is reused");
+        std::atomic<uint64_t> val(0);
+        auto make_large = [&val] {
+            std::array<uint64_t, 64> big;
+            big.fill(1);
+            auto large = [&val](const std::array<uint64_t, 64>& in) { for(auto & it : in) { val += it; } };
+            return async::detail::task_ptr::make<async::task<decltype(large), std::array<uint64_t, 64>>>(std::move(large), std::move(big));
+        };
+        static_assert(async::detail::task_pool_fits<async::task<std::function<void(const std::array<uint64_t, 64>&)>, std::array<uint64_t, 64>>>(), "should come from the pool");
+        auto before = async::task_pool_snapshot();
+        std::vector<async::detail::task_ptr> tasks;
+        for(int i = 0 ; i < 1000 ; i++) {
+            tasks.push_back(make_large());
+        }
+        for(auto & it : tasks) {
+            it->run_v();
+        }
+        tasks.clear();
+        auto local = async::task_pool_snapshot();
+        assert(local.allocated - before.allocated == 1000 && local.freed - before.freed == 1000);
+        assert(local.remote_freed == before.remote_freed);
+        assert(val == 64000);
+
+        // freed on another thread, handed back in one batch
+        for(int round = 0 ; round < 10 ; round++) {
+            for(int i = 0 ; i < 1000 ; i++) {
+                tasks.push_back(make_large());
+            }
+            std::thread consumer([&tasks] {
+                for(auto & it : tasks) {
+                    it->run_v();
+                }
+                tasks.clear();
+            });
+            consumer.join();
+        }
+        auto remote = async::task_pool_snapshot();
+        log_v("%d slabs, %d remote frees", (int)remote.slabs, (int)(remote.remote_freed - local.remote_freed));
+        assert(remote.remote_freed - local.remote_freed == 10000);
+        assert(remote.allocated - remote.freed == before.allocated - before.freed);
+        assert(remote.slabs == local.slabs);
+
+        // slabs of an exited thread go to the next one
+        auto first = remote;
+        for(int round = 0 ; round < 10 ; round++) {
+            std::thread producer([&] {
+                for(int i = 0 ; i < 1000 ; i++) {
+                    tasks.push_back(make_large());
+                }
+                tasks.clear();
+            });
+            producer.join();
+            if(round == 0) {
+                first = async::task_pool_snapshot();
+            }
+        }
+        auto adopted = async::task_pool_snapshot();
+        assert(adopted.slabs == first.slabs);
+        assert(adopted.reserved_bytes == adopted.slabs * async::detail::task_pool_slab_size);
+        log("OK");
+    }
+    {
+        log("strand inbox nodes come from the task pool");
+        int ran = 0;
+        auto before = async::task_pool_snapshot();
+        {
+            async::detail::strand strand(1000, false);
+            for(int i = 0 ; i < 1000 ; i++) {
+                auto t = async::make_task([&ran] { ran++; });
+                strand.push(async::detail::make_task_ptr(std::move(t)));
+            }
+            auto pushed = async::task_pool_snapshot();
+            assert(pushed.allocated - before.allocated == 1000);
+            strand.drain([] { assert(false); });
+        }
+        auto after = async::task_pool_snapshot();
+        log_v("ran=%d", ran);
+        assert(ran == 1000);
+        assert(after.allocated - before.allocated == 1000 && after.freed - before.freed == 1000);
+        log("OK");
+    }
+#endif
+    {
+        log("move-only callable and after with captures");
+        auto owned = std::make_unique<int>(41);
+        int res = 0;
+        auto t = async::make_task([o = std::move(owned)] { return *o + 1; });
+        t.after = [&res](int ret) { res = ret; };
+        async::task_queue queue;
+        queue.add(t);
+        while(queue.next());
+        log_v("res=%d", res);
+        assert(res == 42);
+        log("OK");
+    }
 }
 
 void task_queue_test()
@@ -131,6 +326,96 @@ void task_queue_test()
         assert(val==(n*(n+1)/2)*2);
         log("OK");
     }
+    {
+        log("add_range with tasks and after");
+        async::task_queue queue;
+        uint64_t val = 0;
+        const uint64_t n = iterations;
+        std::vector<async::detail::task_ptr> batch;
+        for(uint64_t i = 1 ; i <= n ; i++) {
+            auto t = async::make_task([&](uint64_t in) { val += in; return in; }, (uint64_t)i);
+            t.after = [&](uint64_t i){ val += i; };
+            batch.push_back(async::detail::make_task_ptr(std::move(t)));
+        }
+        queue.add_range(batch.begin(), batch.end());
+        assert(queue.size() == n);
+        while(queue.next());
+        log_v("val=%" PRId64 " n=%" PRId64 " t=%" PRId64, val, n, (n*(n+1)/2));
+        assert(val==(n*(n+1)/2)*2);
+        log("OK");
+    }
+    {
+        log("lock-free backend with concurrent producers and consumers");
+        async::task_queue_options options;
+        options.backend = async::queue_backend::lock_free;
+        options.capacity = 1024;
+        async::task_queue queue(options);
+        std::atomic<uint64_t> val(0);
+        std::atomic<uint64_t> ct(0);
+        const uint64_t n = iterations;
+        const int producers = 4;
+        std::vector<std::thread> threads;
+        for(int p = 0 ; p < producers ; p++) {
+            threads.emplace_back([&, p] {
+                for(uint64_t i = p + 1 ; i <= n ; i += producers) {
+                    queue.add([&](uint64_t in) { val += in; ++ct; }, (uint64_t)i);
+                }
+            });
+            threads.emplace_back([&] {
+                while(ct.load() < n) {
+                    if(!queue.next()) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for(auto & it : threads) {
+            it.join();
+        }
+        log_v("val=%" PRId64 " n=%" PRId64 " t=%" PRId64, val.load(), n, (n*(n+1)/2));
+        assert(val==(n*(n+1)/2));
+        assert(!queue.has_next() && queue.size() == 0);
+        log("OK");
+    }
+    {
+        log("cancellation groups");
+        async::cancel_group outer;
+        async::task_queue_options options;
+        options.cancel_parent = outer.token();
+        async::task_queue queue(options);
+        std::atomic<uint64_t> ct(0);
+        const uint64_t n = 1000;
+        for(uint64_t i = 0 ; i < n ; i++) {
+            queue.add([&] { ++ct; });
+        }
+        auto added = queue.token();
+        queue.cancellation.cancel();
+        assert(added.cancelled() && !queue.token().cancelled());
+        queue.add([&] { ++ct; });
+        while(queue.next());
+        assert(ct == 1);
+        // a task's own token wins over the queue's
+        async::cancel_group own(queue.cancellation.token());
+        for(uint64_t i = 0 ; i < n ; i++) {
+            auto t = async::make_task([&] { ++ct; });
+            t.token = own.token();
+            queue.add(t);
+        }
+        outer.cancel();
+        assert(own.cancelled() && queue.cancellation.cancelled());
+        while(queue.next());
+        assert(ct == 1);
+        // a recycled block does not revive tokens of the group that owned it
+        async::cancel_token stale;
+        {
+            async::cancel_group g;
+            stale = g.token();
+            assert(!stale.cancelled());
+        }
+        async::cancel_group reuse;
+        assert(stale.cancelled() && !reuse.cancelled() && !async::cancel_token().cancelled());
+        log("OK");
+    }
 }
 
 void thread_pool_test()
@@ -155,6 +440,52 @@ void thread_pool_test()
         assert(val==(n*(n+1)/2));
         log("OK");
     }
+    {
+        log("async dispatch with work stealing, tasks spawning tasks");
+        std::atomic<uint64_t> val(0);
+        const uint64_t n = iterations;
+        std::atomic<uint64_t> ct(n);
+        {
+            async::thread_pool_options options;
+            options.work_stealing = true;
+            options.queue.backend = async::queue_backend::lock_free;
+            async::thread_pool pool(options);
+            for(uint64_t i = 1 ; i <= n ; i += 2)  {
+                async::run(pool, [&](uint64_t in) {
+                    val += in;
+                    --ct;
+                    async::run(pool, [&](uint64_t in) { val += in; --ct; }, in + 1);
+                }, (uint64_t)i);
+            }
+            while(ct.load() > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        log_v("val=%" PRId64 " n=%" PRId64 " t=%" PRId64, val.load(), n, (n*(n+1)/2));
+        assert(val==(n*(n+1)/2));
+        log("OK");
+    }
+    {
+        log("bulk dispatch on any thread");
+        std::atomic<uint64_t> val(0);
+        const uint64_t n = iterations;
+        std::atomic<uint64_t> ct(n);
+        std::vector<uint64_t> input(n);
+        std::iota(input.begin(), input.end(), 1);
+        {
+            async::thread_pool pool;
+            const uint64_t batch = 10000;
+            for(uint64_t i = 0 ; i < n ; i += batch) {
+                async::run_bulk(pool, input.begin() + i, input.begin() + std::min(i + batch, n), [&](uint64_t in) { val += in; --ct; });
+            }
+            while(ct.load() > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        log_v("val=%" PRId64 " n=%" PRId64 " t=%" PRId64, val.load(), n, (n*(n+1)/2));
+        assert(val==(n*(n+1)/2));
+        log("OK");
+    }
     {
         log("sync dispatch on any thread");
         std::atomic<uint64_t> val(0);
@@ -202,8 +533,902 @@ void thread_pool_test()
         }
         log("OK");
     }
+    {
+        log("serial queue with concurrent producers and a small drain budget");
+        const int producers = 4;
+        const int n = iterations / producers;
+        async::thread_pool pool(4);
+        async::task_queue_options options;
+        options.strand_budget = 8;
+        async::task_queue queue(options);
+        std::array<int, producers> last;
+        last.fill(-1);
+        std::atomic<int> inside(0);
+        std::atomic<int> ct(0);
+        std::vector<std::thread> threads;
+        for(int p = 0 ; p < producers ; p++) {
+            threads.emplace_back([&, p] {
+                for(int i = 0 ; i < n ; i++) {
+                    async::run(pool, queue, [&, p, i] {
+                        assert(inside.fetch_add(1) == 0);
+                        assert(last[p] == i - 1);
+                        last[p] = i;
+                        inside.fetch_sub(1);
+                        ++ct;
+                    });
+                }
+            });
+        }
+        for(auto & it : threads) {
+            it.join();
+        }
+        while(ct.load() < n * producers) {
+            std::this_thread::yield();
+        }
+        for(auto & it : last) {
+            assert(it == n - 1);
+        }
+        assert(queue.strand()->size() == 0);
+        log("OK");
+    }
+    {
+        log("parked workers wake on submission");
+        const int n = 2000;
+        async::thread_pool pool(4);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        uint64_t worst = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0 ; i < n ; i++) {
+            auto t0 = std::chrono::steady_clock::now();
+            std::atomic<bool> done(false);
+            async::run(pool, [&done] { done = true; });
+            while(!done.load()) {
+                std::this_thread::yield();
+            }
+            uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+            worst = std::max(worst, us);
+        }
+        auto total = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        log_v("total=%" PRId64 "ms worst=%" PRId64 "us", (int64_t)total, worst);
+        // a lost wakeup would cost a whole polling period
+        assert(total < 2000);
+        log("OK");
+    }
+    {
+        log("priority lanes drain high first and age lower lanes");
+        for(int aging : { 32, 4 }) {
+            async::thread_pool_options opts;
+            opts.thread_count = 1;
+            opts.priority_aging = aging;
+            async::thread_pool pool(opts);
+            std::atomic<bool> started(false);
+            std::atomic<bool> gate(false);
+            std::vector<int> ran;
+            std::atomic<int> ct(0);
+            async::run(pool, [&] {
+                started = true;
+                while(!gate.load()) {
+                    std::this_thread::yield();
+                }
+            });
+            while(!started.load()) {
+                std::this_thread::yield();
+            }
+            for(int i = 0 ; i < 10 ; i++) {
+                async::run(pool, async::priority::low, [&] { ran.push_back(0); ++ct; });
+            }
+            for(int i = 0 ; i < 20 ; i++) {
+                async::run(pool, async::priority::high, [&] { ran.push_back(1); ++ct; });
+            }
+            assert(pool.depth(async::priority::low) == 10);
+            assert(pool.depth(async::priority::high) == 20);
+            assert(pool.depth(async::priority::normal) == 0);
+            gate = true;
+            while(ct.load() < 30) {
+                std::this_thread::yield();
+            }
+            auto first_low = std::find(ran.begin(), ran.end(), 0) - ran.begin();
+            log_v("aging=%d first_low=%d", aging, (int)first_low);
+            assert(first_low == (aging == 32 ? 20 : 4));
+        }
+        log("OK");
+    }
+    {
+        log("numa-aware pool routes to the caller's node and steals across nodes");
+        auto nodes = async::numa_topology();
+        assert(!nodes.empty() && !nodes[0].cpus.empty());
+        assert((async::detail::parse_cpu_list("0-2,5,7-8") == std::vector<int> { 0, 1, 2, 5, 7, 8 }));
+        async::thread_pool_options opts;
+        opts.thread_count = 4;
+        opts.numa_aware = true;
+        opts.pin_threads = true;
+        // two nodes sharing every CPU: the caller's CPU maps to the last one
+        std::vector<int> cpus;
+        for(auto & it : nodes) {
+            cpus.insert(cpus.end(), it.cpus.begin(), it.cpus.end());
+        }
+        opts.topology = { { 0, cpus }, { 1, cpus } };
+        async::thread_pool pool(opts);
+        assert(pool.node_count() == 2);
+        std::atomic<int> started(0);
+        std::atomic<bool> gate(false);
+        for(int i = 0 ; i < 4 ; i++) {
+            async::run(pool, [&] {
+                ++started;
+                while(!gate.load()) {
+                    std::this_thread::yield();
+                }
+            });
+        }
+        while(started.load() < 4) {
+            std::this_thread::yield();
+        }
+        std::atomic<uint64_t> val(0);
+        const uint64_t n = 1000;
+        for(uint64_t i = 1 ; i <= n ; i++) {
+            async::run(pool, [&val](uint64_t in) { val += in; }, (uint64_t)i);
+        }
+        assert(pool.node_depth(1) == n && pool.node_depth(0) == 0);
+        gate = true;
+        while(val.load() != n * (n + 1) / 2) {
+            std::this_thread::yield();
+        }
+        log("OK");
+    }
+    {
+        log("elastic pool grows past blocked workers and shrinks when idle");
+        for(bool stealing : { false, true }) {
+            async::thread_pool_options opts;
+            opts.thread_count = 1;
+            opts.max_threads = 4;
+            opts.work_stealing = stealing;
+            opts.idle_timeout = std::chrono::milliseconds(50);
+            opts.stall_timeout = std::chrono::milliseconds(10);
+            async::thread_pool pool(opts);
+            assert(pool.thread_count() == 1 && pool.max_thread_count() == 4);
+
+            // the only worker blocks on a task queued behind it
+            std::atomic<bool> gate(false);
+            std::atomic<bool> done(false);
+            async::run(pool, [&] {
+                async::blocking_section blocking;
+                while(!gate.load()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                done = true;
+            });
+            async::run(pool, [&] { gate = true; });
+            while(!done.load()) {
+                std::this_thread::yield();
+            }
+            assert(pool.thread_count() >= 2);
+
+            // no blocking_section: the stalled worker is noticed by sampling
+            std::atomic<bool> first(false);
+            std::atomic<bool> second(false);
+            async::run(pool, [&] {
+                while(!second.load()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                first = true;
+            });
+            async::run(pool, [&] {
+                while(!second.load()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+            async::run(pool, [&] { second = true; });
+            while(!first.load()) {
+                std::this_thread::yield();
+            }
+            assert(pool.thread_count() <= 4);
+
+            auto start = std::chrono::steady_clock::now();
+            while(pool.thread_count() > 1 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            log_v("stealing=%d threads after idle=%d", (int)stealing, (int)pool.thread_count());
+            assert(pool.thread_count() == 1);
+            // retired slots are reused
+            std::atomic<int> ct(0);
+            for(int i = 0 ; i < 1000 ; i++) {
+                async::run(pool, [&] { ++ct; });
+            }
+            while(ct.load() < 1000) {
+                std::this_thread::yield();
+            }
+        }
+        log("OK");
+    }
+    {
+        log("drain and shutdown block without spinning");
+        async::thread_pool pool(2);
+        std::atomic<int> ct(0);
+        for(int i = 0 ; i < 1000 ; i++) {
+            async::run(pool, [&] { ++ct; });
+        }
+        assert(pool.drain());
+        assert(ct == 1000);
+        auto start = std::chrono::steady_clock::now();
+        assert(pool.drain());
+        auto idle_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        log_v("drain of an idle pool took %dus", (int)idle_us);
+
+        // graceful queue shutdown runs what is queued
+        {
+            async::task_queue queue;
+            ct = 0;
+            for(int i = 0 ; i < 100 ; i++) {
+                async::run(pool, queue, [&] {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    ++ct;
+                });
+            }
+            assert(queue.drain());
+            assert(ct == 100);
+            async::run(pool, queue, [&] { ++ct; });
+            assert(queue.shutdown());
+            assert(ct == 101);
+            async::run(pool, queue, [&] { ++ct; });
+            assert(queue.size() == 0 && ct == 101);
+        }
+        // cancel skips queued tasks and waits for the running one
+        {
+            async::task_queue queue;
+            std::atomic<bool> started(false);
+            ct = 0;
+            async::run(pool, queue, [&] {
+                started = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                ++ct;
+            });
+            for(int i = 0 ; i < 100 ; i++) {
+                async::run(pool, queue, [&] { ++ct; });
+            }
+            while(!started.load()) {
+                std::this_thread::yield();
+            }
+            assert(queue.shutdown(async::shutdown_mode::cancel));
+            assert(ct == 1);
+        }
+        // a deadline bounds the wait
+        {
+            async::task_queue queue;
+            std::atomic<bool> gate(false);
+            async::run(pool, queue, [&] {
+                while(!gate.load()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+            start = std::chrono::steady_clock::now();
+            assert(!queue.drain(start + std::chrono::milliseconds(20)));
+            assert(!queue.shutdown(async::shutdown_mode::graceful, start + std::chrono::milliseconds(40)));
+            assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+            gate = true;
+            assert(pool.drain());
+        }
+        // plain queue drained by its consumer thread
+        {
+            async::task_queue queue;
+            ct = 0;
+            for(int i = 0 ; i < 1000 ; i++) {
+                queue.add([&] { ++ct; });
+            }
+            std::thread consumer([&] { while(queue.next()); });
+            assert(queue.drain());
+            assert(ct == 1000);
+            consumer.join();
+        }
+
+        // pool shutdown: graceful runs everything, cancel drops the backlog
+        {
+            async::thread_pool graceful(1);
+            ct = 0;
+            for(int i = 0 ; i < 100 ; i++) {
+                async::run(graceful, [&] { ++ct; });
+            }
+            assert(graceful.shutdown());
+            assert(ct == 100);
+            async::run(graceful, [&] { ++ct; });
+            assert(ct == 100);
+        }
+        {
+            async::thread_pool cancelled(1);
+            std::atomic<bool> started(false);
+            ct = 0;
+            async::run(cancelled, [&] {
+                started = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                ++ct;
+            });
+            while(!started.load()) {
+                std::this_thread::yield();
+            }
+            for(int i = 0 ; i < 100 ; i++) {
+                async::run(cancelled, [&] { ++ct; });
+            }
+            assert(!cancelled.shutdown(async::shutdown_mode::cancel));
+            assert(ct == 1);
+        }
+        log("OK");
+    }
+    {
+        log("deadline tasks run earliest first, ahead of plain tasks");
+        async::thread_pool pool(1);
+        std::atomic<bool> gate(false);
+        std::atomic<bool> started(false);
+        async::run(pool, [&] {
+            started = true;
+            while(!gate.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        while(!started.load()) {
+            std::this_thread::yield();
+        }
+        std::mutex ran_mutex;
+        std::vector<int> ran;
+        auto record = [&](int i) {
+            std::lock_guard<std::mutex> lk(ran_mutex);
+            ran.push_back(i);
+        };
+        async::run(pool, [&] { record(-1); });
+        auto now = std::chrono::steady_clock::now();
+        int shuffled[] = { 7, 2, 9, 0, 5, 3, 8, 1, 6, 4 };
+        for(auto i : shuffled) {
+            async::run_before(pool, now + std::chrono::seconds(10) + std::chrono::milliseconds(i), [&record, i] { record(i); });
+        }
+        assert(pool.deadline_depth() == 10);
+        gate = true;
+        assert(pool.drain());
+        assert(ran.size() == 11);
+        for(int i = 0 ; i < 10 ; i++) {
+            assert(ran[static_cast<std::size_t>(i)] == i);
+        }
+        assert(ran.back() == -1);
+        assert(pool.deadlines().missed == 0 && pool.deadlines().shed == 0);
+
+        // late tasks still run and are counted as missed
+        std::atomic<int> ct(0);
+        started = false;
+        gate = false;
+        async::run(pool, [&] {
+            started = true;
+            while(!gate.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        while(!started.load()) {
+            std::this_thread::yield();
+        }
+        now = std::chrono::steady_clock::now();
+        for(int i = 0 ; i < 5 ; i++) {
+            async::run_before(pool, now, [&] { ++ct; });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        gate = true;
+        assert(pool.drain());
+        assert(ct == 5);
+        auto stats = pool.deadlines();
+        log_v("missed %d shed %d", (int)stats.missed, (int)stats.shed);
+        assert(stats.missed == 5 && stats.shed == 0);
+
+        // with shed_expired they are dropped instead
+        async::thread_pool_options opts;
+        opts.thread_count = 1;
+        opts.shed_expired = true;
+        async::thread_pool shedding(opts);
+        ct = 0;
+        now = std::chrono::steady_clock::now();
+        for(int i = 0 ; i < 5 ; i++) {
+            async::run_before(shedding, now, [&] { ++ct; });
+        }
+        async::run_before(shedding, now + std::chrono::seconds(10), [&] { ++ct; });
+        assert(shedding.drain());
+        stats = shedding.deadlines();
+        assert(ct == 1 && stats.shed == 5 && stats.missed == 0);
+
+        // a shed task still runs its hooks, so its waiter is released
+        async::detail::sync_hook hook;
+        auto hooked = async::make_static_task([&ct] { ++ct; });
+        hooked.link(hook);
+        async::run_before(shedding, std::chrono::steady_clock::now() - std::chrono::milliseconds(1), hooked);
+        hook.wait();
+        assert(ct == 1 && shedding.deadlines().shed == 6);
+
+        // the latest possible deadline is a deadline like any other
+        async::run_before(pool, std::chrono::steady_clock::time_point::max(), [&] { ++ct; });
+        assert(pool.drain());
+        assert(ct == 2 && pool.deadline_depth() == 0);
+        log("OK");
+    }
+    {
+        log("tasks spawned from a worker run next, on the same worker");
+        async::thread_pool_options opts;
+        opts.thread_count = 1;
+        opts.next_slot = true;
+        async::thread_pool pool(opts);
+        std::mutex ran_mutex;
+        std::vector<int> ran;
+        auto record = [&](int i) {
+            std::lock_guard<std::mutex> lk(ran_mutex);
+            ran.push_back(i);
+        };
+        std::atomic<bool> gate(false);
+        std::atomic<bool> started(false);
+        async::run(pool, [&] {
+            started = true;
+            while(!gate.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            async::run(pool, [&] { record(1); });
+            // displaces 1 to the back of the queue
+            async::run(pool, [&] { record(2); });
+        });
+        while(!started.load()) {
+            std::this_thread::yield();
+        }
+        async::run(pool, [&] { record(0); });
+        gate = true;
+        assert(pool.drain());
+        assert((ran == std::vector<int> { 2, 0, 1 }));
+
+        // a chain of continuations yields to queued tasks every few links
+        ran.clear();
+        started = false;
+        gate = false;
+        std::function<void(int)> link = [&](int i) {
+            record(i);
+            if(i < 10) {
+                async::run(pool, [&link, i] { link(i + 1); });
+            }
+        };
+        async::run(pool, [&] {
+            started = true;
+            while(!gate.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            async::run(pool, [&link] { link(1); });
+        });
+        while(!started.load()) {
+            std::this_thread::yield();
+        }
+        async::run(pool, [&] { record(-1); });
+        gate = true;
+        assert(pool.drain());
+        assert(ran.size() == 11);
+        auto queued_at = std::find(ran.begin(), ran.end(), -1) - ran.begin();
+        log_v("queued task ran at position %d of the chain", (int)queued_at);
+        assert(queued_at <= 4);
+        ran.erase(ran.begin() + queued_at);
+        for(int i = 0 ; i < 10 ; i++) {
+            assert(ran[static_cast<std::size_t>(i)] == i + 1);
+        }
+
+        // another worker steals the slot when its owner waits on it
+        opts.thread_count = 2;
+        for(int stealing = 0 ; stealing < 2 ; stealing++) {
+            opts.work_stealing = stealing == 1;
+            async::thread_pool pair(opts);
+            std::atomic<int> ct(0);
+            for(int i = 0 ; i < 20 ; i++) {
+                async::run(pair, [&] {
+                    std::atomic<bool> done(false);
+                    async::run(pair, [&] { done = true; });
+                    while(!done.load()) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    }
+                    ++ct;
+                });
+                assert(pair.drain());
+            }
+            assert(ct == 20);
+        }
+        log("OK");
+    }
+}
+
+void future_test()
+{
+    using namespace unpause;
+    log("------- Testing async::future -------");
+    async::thread_pool pool;
+    {
+        log("get and wait");
+        auto f = async::run(pool, async::use_future, [](int a, int b) { return a * b; }, 6, 7);
+        f.wait();
+        assert(f.is_ready());
+        int res = f.get();
+        log_v("res=%d", res);
+        assert(res == 42 && !f.valid());
+        log("OK");
+    }
+    {
+        log("then chains run on the pool without blocking");
+        auto f = async::run(pool, async::use_future, [] { return std::string("fut"); })
+            .then([](std::string s) { return s + "ure"; })
+            .then([](std::string s) { return s.size(); });
+        auto res = f.get();
+        log_v("res=%zu", res);
+        assert(res == 6);
+        auto v = async::run(pool, async::use_future, [] {}).then([] { return 1; });
+        assert(v.get() == 1);
+        log("OK");
+    }
+    {
+        log("exceptions propagate through then");
+        bool called = false;
+        auto f = async::run(pool, async::use_future, []() -> int { throw std::runtime_error("boom"); })
+            .then([&called](int) { called = true; return 0; });
+        bool caught = false;
+        try {
+            f.get();
+        } catch(const std::runtime_error& e) {
+            caught = std::string(e.what()) == "boom";
+        }
+        assert(caught && !called);
+        log("OK");
+    }
+    {
+        log("fan-out / fan-in");
+        const int n = 10000;
+        std::vector<async::future<uint64_t>> fs;
+        for(int i = 1 ; i <= n ; i++) {
+            fs.push_back(async::run(pool, async::use_future, [](uint64_t in) { return in * 2; }, (uint64_t)i));
+        }
+        uint64_t sum = 0;
+        for(auto & it : fs) {
+            sum += it.get();
+        }
+        log_v("sum=%" PRId64, sum);
+        assert(sum == (uint64_t)n * (n + 1));
+        log("OK");
+    }
+    {
+        log("broken promise");
+        async::future<int> f;
+        {
+            async::promise<int> p;
+            f = p.get_future();
+        }
+        bool caught = false;
+        try {
+            f.get();
+        } catch(const std::future_error& e) {
+            caught = e.code() == std::future_errc::broken_promise;
+        }
+        assert(caught);
+        log("OK");
+    }
+    {
+        log("when_all and when_any");
+        async::thread_pool pool(4);
+        std::vector<async::future<int>> fs;
+        for(int i = 0 ; i < 100 ; i++) {
+            fs.push_back(async::run(pool, async::use_future, [](int in) { return in * 2; }, i));
+        }
+        auto all = async::when_all(std::move(fs)).get();
+        assert(all.size() == 100);
+        for(int i = 0 ; i < 100 ; i++) {
+            assert(all[i] == i * 2);
+        }
+        std::vector<async::future<void>> vs;
+        std::atomic<int> ct(0);
+        for(int i = 0 ; i < 100 ; i++) {
+            vs.push_back(async::run(pool, async::use_future, [&ct] { ++ct; }));
+        }
+        async::when_all(std::move(vs)).get();
+        assert(ct == 100);
+        async::promise<int> never;
+        std::vector<async::future<int>> any;
+        any.push_back(never.get_future());
+        any.push_back(async::run(pool, async::use_future, [] { return 7; }));
+        auto first = async::when_any(std::move(any)).get();
+        assert(first.first == 1 && first.second == 7);
+        never.set_value(1);
+        std::vector<async::future<int>> failing;
+        failing.push_back(async::run(pool, async::use_future, [] { return 1; }));
+        failing.push_back(async::run(pool, async::use_future, []() -> int { throw std::runtime_error("boom"); }));
+        bool caught = false;
+        try {
+            async::when_all(std::move(failing)).get();
+        } catch(const std::runtime_error&) {
+            caught = true;
+        }
+        assert(caught);
+        log("OK");
+    }
+}
+
+void graph_test()
+{
+    using namespace unpause;
+    log("------- Testing async::task_graph -------");
+    async::thread_pool pool(4);
+    {
+        log("diamond runs in dependency order and can be rerun");
+        async::task_graph graph;
+        std::atomic<int> step(0);
+        int a = -1, b = -1, c = -1, d = -1;
+        auto na = graph.add([&] { a = step++; });
+        auto nb = graph.add([&] { b = step++; }, { na });
+        auto nc = graph.add([&] { c = step++; }, { na }, 10);
+        graph.add([&] { d = step++; }, { nb, nc });
+        assert(graph.rank(na) == 12 && graph.rank(nc) == 11 && graph.rank(nb) == 2);
+        for(int i = 0 ; i < 1000 ; i++) {
+            step = 0;
+            graph.run(pool);
+            assert(a == 0 && b > a && c > a && d == 3);
+        }
+        step = 0;
+        graph.run(pool, async::use_future).get();
+        assert(d == 3);
+        log("OK");
+    }
+    {
+        log("wide graph, exceptions and cycles");
+        async::task_graph graph;
+        std::atomic<int> ct(0);
+        auto root = graph.add([&] { ++ct; });
+        std::vector<async::task_graph::node_id> mid;
+        for(int i = 0 ; i < 1000 ; i++) {
+            mid.push_back(graph.add([&] { ++ct; }, { root }));
+        }
+        auto sink = graph.add([&] { ++ct; });
+        for(auto it : mid) {
+            graph.precede(it, sink);
+        }
+        graph.run(pool);
+        assert(ct == 1002);
+        graph.add([] { throw std::runtime_error("boom"); }, { sink });
+        bool caught = false;
+        try {
+            graph.run(pool);
+        } catch(const std::runtime_error&) {
+            caught = true;
+        }
+        assert(caught);
+        graph.precede(sink, root);
+        caught = false;
+        try {
+            graph.run(pool);
+        } catch(const std::logic_error&) {
+            caught = true;
+        }
+        assert(caught);
+        caught = false;
+        try {
+            graph.run(pool, async::use_future);
+        } catch(const std::logic_error&) {
+            caught = true;
+        }
+        assert(caught);
+        log("OK");
+    }
+    {
+        log("ready branches are taken longest first from a worker's own deque");
+        async::thread_pool_options options;
+        options.thread_count = 1;
+        options.work_stealing = true;
+        async::thread_pool single(options);
+        async::task_graph graph;
+        std::vector<char> ran;
+        auto root = graph.add([&] { ran.push_back('r'); });
+        graph.add([&] { ran.push_back('s'); }, { root }, 1);
+        graph.add([&] { ran.push_back('l'); }, { root }, 10);
+        graph.add([&] { ran.push_back('m'); }, { root }, 5);
+        for(int i = 0 ; i < 100 ; i++) {
+            ran.clear();
+            graph.run(single);
+            assert((ran == std::vector<char> { 'r', 'l', 'm', 's' }));
+        }
+        log("OK");
+    }
+}
+
+void parallel_test()
+{
+    using namespace unpause;
+    log("------- Testing async::parallel -------");
+    async::thread_pool pool(4);
+    {
+        log("parallel_for writes every index once");
+        const uint64_t n = iterations;
+        std::vector<uint64_t> out(n, 0);
+        async::parallel_for(pool, (uint64_t)0, n, [&](uint64_t i) { out[i] += i * 2; });
+        for(uint64_t i = 0 ; i < n ; i++) {
+            assert(out[i] == i * 2);
+        }
+        log("OK");
+    }
+    {
+        log("parallel_reduce with per-worker partials");
+        const uint64_t n = iterations;
+        auto sum = async::parallel_reduce(pool, (uint64_t)1, n + 1, (uint64_t)0, [](uint64_t i) { return i; }, std::plus<uint64_t>());
+        log_v("sum=%" PRId64 " t=%" PRId64, sum, (n*(n+1)/2));
+        assert(sum == (n*(n+1)/2));
+        log("OK");
+    }
+    {
+        log("parallel_transform with uneven work and a small grain");
+        std::vector<int> in(2000);
+        std::iota(in.begin(), in.end(), 0);
+        std::vector<int> out(in.size());
+        async::parallel_transform(pool, in.begin(), in.end(), out.begin(), [](int v) {
+            if(v % 500 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            return v + 1;
+        }, 4);
+        for(std::size_t i = 0 ; i < in.size() ; i++) {
+            assert(out[i] == in[i] + 1);
+        }
+        log("OK");
+    }
+    {
+        log("exceptions propagate to the caller");
+        bool caught = false;
+        try {
+            async::parallel_for(pool, 0, 10000, [](int i) {
+                if(i == 4321) {
+                    throw std::runtime_error("boom");
+                }
+            }, 16);
+        } catch(const std::runtime_error&) {
+            caught = true;
+        }
+        assert(caught);
+        log("OK");
+    }
+    {
+        log("nested inside a pool task");
+        auto f = async::run(pool, async::use_future, [&pool] {
+            return async::parallel_reduce(pool, 0, 1000, 0, [](int i) { return i; }, std::plus<int>());
+        });
+        auto res = f.get();
+        log_v("res=%d", res);
+        assert(res == 499500);
+        log("OK");
+    }
+}
+
+#if defined(UNPAUSE_ASYNC_HAS_COROUTINES)
+static unpause::async::co_task<int> coro_add_later(unpause::async::thread_pool& pool, unpause::async::run_loop& loop, int value) {
+    co_await unpause::async::schedule_on(pool);
+    co_await unpause::async::sleep_until(loop, std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+    co_return value + 1;
 }
 
+static unpause::async::co_task<int> coro_chain(unpause::async::thread_pool& pool, unpause::async::run_loop& loop, unpause::async::task_queue& queue) {
+    int value = co_await coro_add_later(pool, loop, 20);
+    co_await unpause::async::schedule_on(pool, queue);
+    co_return value * 2;
+}
+
+static unpause::async::co_task<> coro_increment(unpause::async::thread_pool& pool, unpause::async::task_queue& queue, int& counter) {
+    co_await unpause::async::schedule_on(pool, queue);
+    counter++; // serialised by queue
+}
+
+struct coro_frame_tracker {
+    ~coro_frame_tracker() { ++destroyed; }
+    std::atomic<int>& destroyed;
+};
+
+static unpause::async::co_task<int> coro_wrap_increment(unpause::async::thread_pool& pool, unpause::async::task_queue& queue, int& counter, std::atomic<int>& destroyed) {
+    coro_frame_tracker tracker { destroyed };
+    co_await coro_increment(pool, queue, counter);
+    co_return counter;
+}
+
+void coro_test()
+{
+    using namespace unpause;
+    log("------- Testing async coroutines -------");
+    async::thread_pool pool(4);
+    async::run_loop loop;
+    async::task_queue queue;
+    {
+        log("co_await pool, run_loop timer and serial queue");
+        auto f = async::co_spawn(pool, coro_chain(pool, loop, queue));
+        int res = f.get();
+        log_v("res=%d", res);
+        assert(res == 42);
+        log("OK");
+    }
+    {
+        log("resumptions on a task_queue are serialised");
+        const int n = 10000;
+        int counter = 0;
+        std::vector<async::future<void>> fs;
+        for(int i = 0 ; i < n ; i++) {
+            fs.push_back(async::co_spawn(pool, coro_increment(pool, queue, counter)));
+        }
+        for(auto & it : fs) {
+            it.get();
+        }
+        log_v("counter=%d", counter);
+        assert(counter == n);
+        log("OK");
+    }
+    {
+        log("resumptions dropped by a closed or cancelled queue break the future");
+        auto broken = [](async::future<int>& f) {
+            try {
+                f.get();
+            } catch(const std::future_error& e) {
+                return e.code() == std::future_errc::broken_promise;
+            }
+            return false;
+        };
+        int counter = 0;
+        std::atomic<int> destroyed(0);
+        async::task_queue closed;
+        assert(closed.shutdown());
+        auto f = async::co_spawn(pool, coro_wrap_increment(pool, closed, counter, destroyed));
+        assert(broken(f));
+        assert(counter == 0 && destroyed == 1);
+
+        async::task_queue cancelled;
+        std::atomic<bool> gate(false);
+        async::run(pool, cancelled, [&gate] {
+            while(!gate.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        f = async::co_spawn(pool, coro_wrap_increment(pool, cancelled, counter, destroyed));
+        while(cancelled.strand()->size() < 2) {
+            std::this_thread::yield();
+        }
+        cancelled.cancellation.cancel();
+        gate = true;
+        assert(broken(f));
+        assert(counter == 0 && destroyed == 2);
+        log("OK");
+    }
+}
+#endif
+
+#if defined(UNPAUSE_ASYNC_METRICS)
+void metrics_test()
+{
+    using namespace unpause;
+    log("------- Testing async metrics -------");
+    {
+        log("task_queue, thread_pool and run_loop counters");
+        async::thread_pool pool(4);
+        pool.set_name("metrics-pool");
+        async::task_queue queue;
+        queue.set_name("metrics-queue");
+        async::run_loop loop;
+        loop.set_name("metrics-loop");
+        const int n = 1000;
+        std::atomic<int> done(0);
+        for(int i = 0 ; i < n ; i++) {
+            async::run(pool, [&done] { ++done; });
+            async::run(pool, queue, [&done] { ++done; });
+        }
+        async::schedule(loop, std::chrono::steady_clock::now() + std::chrono::milliseconds(5), [&done] { ++done; });
+        while(done.load() != 2 * n + 1) {
+            std::this_thread::yield();
+        }
+        auto q = queue.metrics();
+        assert(q.name == "metrics-queue" && q.enqueued == n && q.completed == n && q.wait.count == n && q.run.count == n);
+        auto l = loop.metrics();
+        assert(l.completed == 1 && l.lateness.count == 1 && l.wait.count == 0);
+        auto all = async::metrics_snapshot();
+        assert(all.count("metrics-pool") && all.count("metrics-queue") && all.count("metrics-loop"));
+        auto& p = all["metrics-pool"];
+        // n tasks plus at least one strand batch for the queue
+        assert(p.threads == 4 && p.enqueued > n && p.started <= p.enqueued);
+        assert(p.run.percentile(0.5) <= p.run.percentile(0.99) && p.run.percentile(0.99) <= p.run.max);
+        log_v("pool wait p50=%" PRIu64 "ns p99=%" PRIu64 "ns utilisation=%.4f", p.wait.percentile(0.5), p.wait.percentile(0.99), p.utilisation());
+        log("OK");
+    }
+    assert(!async::metrics_snapshot().count("metrics-queue"));
+}
+#endif
+
 void run_loop_test() {
     log("------- Testing async::run_loop -------");
     using namespace unpause;
@@ -305,6 +1530,283 @@ void run_loop_test() {
         log_v("Diff3=%" PRId64, diff3);
         assert(diff3 <= 4500000 && diff3 > 4000000);
     }
+    {
+        log("schedule with loop and queue skips timers of a dead queue");
+        async::run_loop loop;
+        std::atomic<int> ct(0);
+        async::task_queue kept;
+        async::schedule(loop, kept, std::chrono::steady_clock::now() + std::chrono::milliseconds(20), [&ct] { ++ct; });
+        {
+            async::task_queue gone;
+            async::schedule(loop, gone, std::chrono::steady_clock::now() + std::chrono::milliseconds(10), [&ct] { ct += 10; });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(ct == 1);
+        log("OK");
+    }
+    {
+        log("many timers fire in deadline order");
+        async::run_loop loop;
+        const int n = 100000;
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<int> offset(0, 500);
+        // the looper is held in a gate timer while the others are added, so
+        // none can fire before a later added, earlier one is in the heap
+        std::atomic<bool> held(false), added(false);
+        async::schedule(loop, std::chrono::steady_clock::now(), [&held, &added] {
+            held = true;
+            while(!added.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        while(!held.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto base = std::chrono::steady_clock::now();
+        std::vector<std::chrono::steady_clock::time_point> fired;
+        fired.reserve(n);
+        std::atomic<int> ct(n);
+        for(int i = 0 ; i < n ; i++) {
+            auto point = base + std::chrono::milliseconds(offset(rng));
+            async::schedule(loop, point, [&fired, &ct, point] {
+                fired.push_back(point);
+                --ct;
+            });
+        }
+        added = true;
+        while(ct.load() > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(std::is_sorted(fired.begin(), fired.end()));
+        assert(loop.size() == 0);
+        log("OK");
+    }    {
+        log("periodic timers keep their beat, coalesce within slack and stop on cancel");
+        using clock = std::chrono::steady_clock;
+        using std::chrono::milliseconds;
+        async::run_loop loop;
+        const auto period = milliseconds(10);
+
+        // fixed rate: a 3ms callback does not push later beats back
+        std::vector<clock::time_point> rate;
+        std::atomic<int> rate_ct(0);
+        async::cancel_group rate_group;
+        async::periodic_options rate_opts;
+        rate_opts.first = clock::now() + period;
+        rate_opts.token = rate_group.token();
+        auto first = rate_opts.first;
+        async::schedule_every(loop, period, [&] {
+            rate.push_back(clock::now());
+            std::this_thread::sleep_for(milliseconds(3));
+            ++rate_ct;
+        }, rate_opts);
+
+        // fixed delay: beats are period apart from the end of the callback
+        std::vector<clock::time_point> delay;
+        std::atomic<int> delay_ct(0);
+        async::cancel_group delay_group;
+        async::periodic_options delay_opts;
+        delay_opts.mode = async::timer_mode::fixed_delay;
+        delay_opts.token = delay_group.token();
+        async::schedule_every(loop, period, [&] {
+            delay.push_back(clock::now());
+            std::this_thread::sleep_for(milliseconds(5));
+            ++delay_ct;
+        }, delay_opts);
+
+        while(rate_ct.load() < 20 || delay_ct.load() < 10) {
+            std::this_thread::sleep_for(milliseconds(1));
+        }
+        rate_group.cancel();
+        delay_group.cancel();
+        std::this_thread::sleep_for(milliseconds(30));
+        assert(loop.size() == 0);
+        int64_t worst = 0;
+        for(std::size_t k = 0 ; k < 20 ; k++) {
+            auto beat = first + (int)(k + 1) * period - period;
+            assert(rate[k] >= beat);
+            worst = std::max<int64_t>(worst, std::chrono::duration_cast<std::chrono::microseconds>(rate[k] - beat).count());
+        }
+        for(std::size_t k = 1 ; k < 10 ; k++) {
+            assert(delay[k] - delay[k - 1] >= period + milliseconds(5));
+        }
+        log_v("fixed rate worst lateness=%dus", (int)worst);
+        // drifting by the 3ms callback would put the 20th beat 57ms late
+        assert(rate[19] - (first + 19 * period) < milliseconds(40));
+
+        // a late beat skips the missed ones instead of bursting
+        std::vector<clock::time_point> skip;
+        std::atomic<int> skip_ct(0);
+        async::cancel_group skip_group;
+        async::periodic_options skip_opts;
+        skip_opts.first = clock::now() + period;
+        skip_opts.token = skip_group.token();
+        first = skip_opts.first;
+        loop.every(period, [&] {
+            skip.push_back(clock::now());
+            if(skip.size() == 1) {
+                std::this_thread::sleep_for(milliseconds(35));
+            }
+            ++skip_ct;
+        }, skip_opts);
+        while(skip_ct.load() < 3) {
+            std::this_thread::sleep_for(milliseconds(1));
+        }
+        skip_group.cancel();
+        assert(skip[1] >= first + 4 * period && skip[2] >= first + 5 * period);
+
+        // two timers 0.9ms apart with 4ms of slack fire in one wake-up
+        const int64_t grid = 1 << 21; // largest power of two ns in 4ms
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>((clock::now() + milliseconds(20)).time_since_epoch()).count();
+        auto base = clock::time_point(std::chrono::nanoseconds((ns / grid + 1) * grid));
+        std::array<clock::time_point, 2> fired;
+        std::atomic<int> fired_ct(0);
+        async::cancel_group pair_group;
+        for(int i = 0 ; i < 2 ; i++) {
+            async::periodic_options opts;
+            opts.slack = milliseconds(4);
+            opts.first = base + std::chrono::microseconds(100 + 900 * i);
+            opts.token = pair_group.token();
+            loop.every(milliseconds(1000), [&, i] {
+                fired[i] = clock::now();
+                ++fired_ct;
+            }, opts);
+        }
+        while(fired_ct.load() < 2) {
+            std::this_thread::sleep_for(milliseconds(1));
+        }
+        pair_group.cancel();
+        auto apart = std::chrono::duration_cast<std::chrono::microseconds>(fired[1] - fired[0]).count();
+        log_v("coalesced timers fired %dus apart", (int)apart);
+        assert(fired[0] >= base + milliseconds(2) && fired[1] >= base + milliseconds(2));
+        assert(apart >= 0 && apart < 500);
+        log("OK");
+    }
+    {
+        log("io reactor shares the looper with timers");
+        async::run_loop_options opts;
+        opts.io = true;
+        async::run_loop loop(opts);
+        assert(loop.io());
+        async::thread_pool pool(2);
+
+        // pipe read on the looper thread, next to a timer
+        int p[2];
+        int rc = pipe(p);
+        assert(rc == 0);
+        std::atomic<int> bytes(0);
+        std::thread::id io_thread, timer_thread;
+        loop.watch(p[0], async::io_read, [&](uint32_t events) {
+            assert(events & async::io_read);
+            char buf[64];
+            auto n = read(p[0], buf, sizeof(buf));
+            io_thread = std::this_thread::get_id();
+            bytes += (int)n;
+        });
+        auto point = std::chrono::steady_clock::now() + std::chrono::milliseconds(30);
+        std::atomic<int64_t> late(-1);
+        async::schedule(loop, point, [&] {
+            timer_thread = std::this_thread::get_id();
+            late = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - point).count();
+        });
+        auto written = write(p[1], "hello", 5);
+        assert(written == 5);
+        while(bytes.load() < 5 || late.load() < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        log_v("timer late by %" PRId64 "us", late.load());
+        assert(io_thread == timer_thread && late.load() < 20000);
+        loop.unwatch(p[0]);
+        written = write(p[1], "x", 1);
+        assert(written == 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(bytes.load() == 5);
+        close(p[0]);
+        close(p[1]);
+
+        // socketpair messages handled on the pool, one callback at a time
+        int sv[2];
+        rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        assert(rc == 0);
+        std::atomic<int> received(0);
+        std::atomic<int> inside(0);
+        async::watch(loop, sv[1], async::io_read, pool, [&](uint32_t) {
+            auto concurrent = ++inside;
+            assert(concurrent == 1);
+            char c;
+            if(read(sv[1], &c, 1) == 1) {
+                ++received;
+            }
+            --inside;
+        });
+        const int n = 1000;
+        for(int i = 0 ; i < n ; i++) {
+            written = write(sv[0], "m", 1);
+            assert(written == 1);
+        }
+        while(received.load() < n) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        loop.unwatch(sv[1]);
+
+        // write readiness through a serial queue
+        async::task_queue queue;
+        std::atomic<bool> writable(false);
+        async::watch(loop, sv[0], async::io_write, pool, queue, [&](uint32_t events) {
+            writable = (events & async::io_write) != 0;
+        });
+        while(!writable.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        loop.unwatch(sv[0]);
+
+        // serial queue run on the looper thread; the watch outlives the queue
+        auto owned = std::make_unique<async::task_queue>();
+        std::atomic<int> handled(0);
+        async::watch(loop, sv[1], async::io_read, *owned, [&](uint32_t) {
+            char c;
+            if(read(sv[1], &c, 1) == 1) {
+                ++handled;
+            }
+        });
+        written = write(sv[0], "q", 1);
+        assert(written == 1);
+        while(handled.load() < 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        owned.reset();
+        written = write(sv[0], "q", 1);
+        assert(written == 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(handled.load() == 1);
+        loop.unwatch(sv[1]);
+        char drained;
+        auto n_read = read(sv[1], &drained, 1);
+        assert(n_read == 1);
+
+        // an fd closed before unwatch() cannot be re-armed and is dropped
+        int q[2];
+        rc = pipe(q);
+        assert(rc == 0);
+        loop.watch(q[0], async::io_read, [](uint32_t) {}, true);
+        bool armed = loop.rearm(q[0]);
+        assert(armed);
+        close(q[0]);
+        armed = loop.rearm(q[0]);
+        assert(!armed);
+        close(q[1]);
+
+        // hang-up is reported as an error
+        std::atomic<uint32_t> seen(0);
+        async::watch(loop, sv[1], async::io_read, pool, [&](uint32_t events) { seen = events; });
+        close(sv[0]);
+        while(!(seen.load() & async::io_error)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        loop.unwatch(sv[1]);
+        close(sv[1]);
+        log("OK");
+    }
 }
 
 void interleave_test() {
@@ -405,6 +1907,15 @@ int main(void)
     task_test();
     task_queue_test();
     thread_pool_test();
+    future_test();
+    parallel_test();
+    graph_test();
+#if defined(UNPAUSE_ASYNC_HAS_COROUTINES)
+    coro_test();
+#endif
+#if defined(UNPAUSE_ASYNC_METRICS)
+    metrics_test();
+#endif
     run_loop_test();
     interleave_test();
     abrupt_exit_test(10000);
@@ -0,0 +1,337 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+// Benchmarks for the async primitives.
+//
+//   bench [--csv | --json] [--quick] [--filter=<name>]
+//
+// Every row reports ops/s over the whole run and the p50/p99/p999 latency of a
+// single operation in nanoseconds.  For asynchronous primitives the latency is
+// the time from submission to the start of execution.  `size` is the payload
+// captured by each task in bytes, or the number of pending timers for schedule.
+
+#include <algorithm>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <array>
+#include <thread>
+#include <type_traits>
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <unpause/async>
+
+using bench_clock = std::chrono::steady_clock;
+
+enum class output_format { text, csv, json };
+
+struct bench_options {
+    output_format format { output_format::text };
+    bool quick { false };
+    std::string filter;
+};
+
+struct bench_result {
+    std::string name;
+    int threads;
+    uint64_t size;
+    uint64_t ops;
+    double ops_per_sec;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+static bench_options options;
+static std::vector<bench_result> results;
+
+template<std::size_t N>
+struct payload {
+    std::array<uint8_t, N> bytes {};
+};
+
+static uint64_t elapsed_ns(bench_clock::time_point start, bench_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if(sorted.empty()) {
+        return 0;
+    }
+    auto idx = static_cast<std::size_t>(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static bool enabled(const char* name) {
+    return options.filter.empty() || strstr(name, options.filter.c_str()) != nullptr;
+}
+
+static void report(const char* name, int threads, uint64_t size, uint64_t ops, uint64_t total_ns, std::vector<uint64_t>& lat) {
+    std::sort(lat.begin(), lat.end());
+    bench_result r { name, threads, size, ops, ops / (total_ns / 1e9),
+        percentile(lat, 0.50), percentile(lat, 0.99), percentile(lat, 0.999) };
+    if(options.format == output_format::text) {
+        printf("%-14s threads=%-3d size=%-8" PRIu64 " %12.0f ops/s   p50=%-8" PRIu64 " p99=%-8" PRIu64 " p999=%-8" PRIu64 "\n",
+            r.name.c_str(), r.threads, r.size, r.ops_per_sec, r.p50, r.p99, r.p999);
+        fflush(stdout);
+    }
+    results.push_back(r);
+}
+
+static uint64_t iterations(uint64_t n) {
+    return options.quick ? std::max<uint64_t>(n / 20, 100) : n;
+}
+
+static std::vector<int> thread_counts() {
+    std::vector<int> counts { 1, 2, 4, static_cast<int>(std::thread::hardware_concurrency()) };
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+    counts.erase(std::remove_if(counts.begin(), counts.end(), [](int c) { return c < 1; }), counts.end());
+    return counts;
+}
+
+static void wait_for(const std::atomic<uint64_t>& counter, uint64_t target) {
+    while(counter.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
+
+// make_task: construction of a task and its type-erased task_ptr
+template<std::size_t N>
+void bench_make_task() {
+    using namespace unpause;
+    const uint64_t n = iterations(1000000);
+    std::vector<uint64_t> lat(n);
+    payload<N> p;
+    uint64_t sink = 0;
+
+    auto start = bench_clock::now();
+    for(uint64_t i = 0 ; i < n ; i++) {
+        auto t0 = bench_clock::now();
+        auto t = async::detail::make_task_ptr(async::make_task([p, i] { return i + p.bytes[0]; }));
+        sink += t.is_inline();
+        lat[i] = elapsed_ns(t0, bench_clock::now());
+    }
+    report("make_task", 1, N, n, elapsed_ns(start, bench_clock::now()), lat);
+    if(sink == uint64_t(-1)) {
+        printf("unreachable\n");
+    }
+}
+
+// task_queue::add followed by task_queue::next, on one thread
+template<std::size_t N>
+void bench_queue(unpause::async::queue_backend backend, const char* add_name, const char* next_name) {
+    using namespace unpause;
+    const uint64_t n = iterations(100000);
+    std::vector<uint64_t> lat(n);
+    payload<N> p;
+    uint64_t sum = 0;
+    async::task_queue_options qopts;
+    qopts.backend = backend;
+    qopts.capacity = 1 << 17;
+    async::task_queue queue(qopts);
+
+    auto start = bench_clock::now();
+    for(uint64_t i = 0 ; i < n ; i++) {
+        auto t0 = bench_clock::now();
+        queue.add([p, i, &sum] { sum += i + p.bytes[0]; });
+        lat[i] = elapsed_ns(t0, bench_clock::now());
+    }
+    report(add_name, 1, N, n, elapsed_ns(start, bench_clock::now()), lat);
+
+    start = bench_clock::now();
+    for(uint64_t i = 0 ; i < n ; i++) {
+        auto t0 = bench_clock::now();
+        queue.next();
+        lat[i] = elapsed_ns(t0, bench_clock::now());
+    }
+    report(next_name, 1, N, n, elapsed_ns(start, bench_clock::now()), lat);
+}
+
+// run(pool, ...): submission to start of execution
+template<std::size_t N>
+void bench_run_pool(int threads) {
+    using namespace unpause;
+    const uint64_t n = iterations(500000);
+    std::vector<uint64_t> lat(n);
+    std::atomic<uint64_t> done(0);
+    payload<N> p;
+    async::thread_pool pool(threads);
+
+    auto start = bench_clock::now();
+    for(uint64_t i = 0 ; i < n ; i++) {
+        auto t0 = bench_clock::now();
+        async::run(pool, [p, i, t0, &lat, &done] {
+            lat[i] = elapsed_ns(t0, bench_clock::now()) + p.bytes[0];
+            done.fetch_add(1, std::memory_order_release);
+        });
+    }
+    wait_for(done, n);
+    report("run_pool", threads, N, n, elapsed_ns(start, bench_clock::now()), lat);
+}
+
+// run_sync(pool, ...): round trip through the pool
+void bench_run_sync(int threads) {
+    using namespace unpause;
+    const uint64_t n = iterations(50000);
+    std::vector<uint64_t> lat(n);
+    uint64_t sum = 0;
+    async::thread_pool pool(threads);
+
+    auto start = bench_clock::now();
+    for(uint64_t i = 0 ; i < n ; i++) {
+        auto t0 = bench_clock::now();
+        async::run_sync(pool, [i, &sum] { sum += i; });
+        lat[i] = elapsed_ns(t0, bench_clock::now());
+    }
+    report("run_sync", threads, 0, n, elapsed_ns(start, bench_clock::now()), lat);
+}
+
+// run(pool, queue, ...): serial queue dispatched on the pool
+template<std::size_t N>
+void bench_run_serial(int threads) {
+    using namespace unpause;
+    const uint64_t n = iterations(200000);
+    std::vector<uint64_t> lat(n);
+    std::atomic<uint64_t> done(0);
+    payload<N> p;
+    async::thread_pool pool(threads);
+    async::task_queue queue;
+
+    auto start = bench_clock::now();
+    for(uint64_t i = 0 ; i < n ; i++) {
+        auto t0 = bench_clock::now();
+        async::run(pool, queue, [p, i, t0, &lat, &done] {
+            lat[i] = elapsed_ns(t0, bench_clock::now()) + p.bytes[0];
+            done.fetch_add(1, std::memory_order_release);
+        });
+    }
+    wait_for(done, n);
+    report("run_serial", threads, N, n, elapsed_ns(start, bench_clock::now()), lat);
+}
+
+// schedule() on a run_loop that already holds `pending` timers, then timers
+// that are already due: latency is the time from their deadline to firing
+void bench_schedule(uint64_t pending) {
+    using namespace unpause;
+    const uint64_t n = iterations(100000);
+    pending = iterations(pending);
+    std::mt19937_64 rng(pending);
+    std::uniform_int_distribution<int64_t> offset(0, 3600 * 1000);
+    std::vector<uint64_t> lat(n);
+    auto far = bench_clock::now() + std::chrono::hours(2);
+    {
+        async::run_loop loop;
+        for(uint64_t i = 0 ; i < pending ; i++) {
+            async::schedule(loop, far + std::chrono::milliseconds(offset(rng)), [] {});
+        }
+
+        auto start = bench_clock::now();
+        for(uint64_t i = 0 ; i < n ; i++) {
+            auto t0 = bench_clock::now();
+            async::schedule(loop, far + std::chrono::milliseconds(offset(rng)), [] {});
+            lat[i] = elapsed_ns(t0, bench_clock::now());
+        }
+        report("schedule", 1, pending, n, elapsed_ns(start, bench_clock::now()), lat);
+    }
+
+    lat.assign(pending, 0);
+    std::atomic<uint64_t> fired(0);
+    async::run_loop drain;
+    auto start = bench_clock::now();
+    for(uint64_t i = 0 ; i < pending ; i++) {
+        auto deadline = bench_clock::now();
+        async::schedule(drain, deadline, [&lat, &fired, deadline, i] {
+            lat[i] = elapsed_ns(deadline, bench_clock::now());
+            fired.fetch_add(1, std::memory_order_release);
+        });
+    }
+    wait_for(fired, pending);
+    report("expire", 1, pending, pending, elapsed_ns(start, bench_clock::now()), lat);
+}
+
+template<class F>
+void for_payloads(F&& f) {
+    f(std::integral_constant<std::size_t, 8>());
+    f(std::integral_constant<std::size_t, 64>());
+    f(std::integral_constant<std::size_t, 512>());
+}
+
+static void print_results() {
+    if(options.format == output_format::csv) {
+        printf("name,threads,size,ops,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+        for(auto & r : results) {
+            printf("%s,%d,%" PRIu64 ",%" PRIu64 ",%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                r.name.c_str(), r.threads, r.size, r.ops, r.ops_per_sec, r.p50, r.p99, r.p999);
+        }
+    } else if(options.format == output_format::json) {
+        printf("[\n");
+        for(std::size_t i = 0 ; i < results.size() ; i++) {
+            auto & r = results[i];
+            printf("  {\"name\": \"%s\", \"threads\": %d, \"size\": %" PRIu64 ", \"ops\": %" PRIu64 ", \"ops_per_sec\": %.0f, "
+                "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 "}%s\n",
+                r.name.c_str(), r.threads, r.size, r.ops, r.ops_per_sec, r.p50, r.p99, r.p999,
+                i + 1 < results.size() ? "," : "");
+        }
+        printf("]\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace unpause;
+    for(int i = 1 ; i < argc ; i++) {
+        if(!strcmp(argv[i], "--csv")) {
+            options.format = output_format::csv;
+        } else if(!strcmp(argv[i], "--json")) {
+            options.format = output_format::json;
+        } else if(!strcmp(argv[i], "--quick")) {
+            options.quick = true;
+        } else if(!strncmp(argv[i], "--filter=", 9)) {
+            options.filter = argv[i] + 9;
+        } else {
+            fprintf(stderr, "usage: %s [--csv | --json] [--quick] [--filter=<name>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(enabled("make_task")) {
+        for_payloads([](auto n) { bench_make_task<decltype(n)::value>(); });
+    }
+    if(enabled("queue")) {
+        for_payloads([](auto n) {
+            bench_queue<decltype(n)::value>(async::queue_backend::locked, "queue_add", "queue_next");
+            bench_queue<decltype(n)::value>(async::queue_backend::lock_free, "queue_lf_add", "queue_lf_next");
+        });
+    }
+    for(int threads : thread_counts()) {
+        if(enabled("run_pool")) {
+            for_payloads([threads](auto n) { bench_run_pool<decltype(n)::value>(threads); });
+        }
+        if(enabled("run_sync")) {
+            bench_run_sync(threads);
+        }
+        if(enabled("run_serial")) {
+            for_payloads([threads](auto n) { bench_run_serial<decltype(n)::value>(threads); });
+        }
+    }
+    if(enabled("schedule") || enabled("expire")) {
+        for(uint64_t pending : { 1000, 100000, 1000000 }) {
+            bench_schedule(pending);
+        }
+    }
+    print_results();
+    return 0;
+}
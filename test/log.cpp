@@ -0,0 +1,173 @@
+/* Copyright (c) 2020 Unpause, SAS.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3.0 of the License, or (at your option) any later version.
+ *  See the file LICENSE included with this distribution for more
+ *  information.
+ */
+
+
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+static std::atomic<int> s_order(0);
+
+static int order() { return s_order.fetch_add(1); }
+
+#define log_v(x, ...) printf("[%d] %3d:\t" x "\n",  order(), __LINE__, ##__VA_ARGS__); fflush(stdout);
+#define log(x) printf("[%d] %3d:\t" x "\n", order(), __LINE__); fflush(stdout);
+
+#define UNPAUSE_LOG_ASYNC
+#define LOG_LEVEL 3
+#include <unpause/__unpause/log.h>
+
+// The lines of path containing tag, from the tag on.
+static std::vector<std::string> tagged_lines(const std::string& path, const char* tag) {
+    std::vector<std::string> res;
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in, line)) {
+        auto pos = line.find(tag);
+        if(pos != std::string::npos) {
+            res.push_back(line.substr(pos));
+        }
+    }
+    return res;
+}
+
+// Checks that path holds "tag 0" to "tag count-1", in that order.
+static bool in_sequence(const std::string& path, const char* tag, int count) {
+    auto lines = tagged_lines(path, tag);
+    if(lines.size() != static_cast<std::size_t>(count)) {
+        return false;
+    }
+    for(int i = 0 ; i < count ; i++) {
+        if(atoi(lines[i].c_str() + strlen(tag)) != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const int exit_records = 1000;
+
+void log_test(const char* self) {
+    log("------- Testing async log backend -------");
+
+    // the records go to stderr, redirected to a file read back by the checks
+    char path[] = "/tmp/unpause_log_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    fflush(stderr);
+    dup2(fd, 2);
+    close(fd);
+
+    {
+        log("records of each thread are written in order");
+        const int threads = 4;
+        const int records = 5000;
+        std::vector<std::thread> producers;
+        for(int t = 0 ; t < threads ; t++) {
+            producers.emplace_back([t] {
+                for(int i = 0 ; i < records ; i++) {
+                    DInfo("ordering %d %d", t, i);
+                }
+            });
+        }
+        for(auto & it : producers) {
+            it.join();
+        }
+        unpause::log::flush();
+        std::vector<int> next(threads, 0);
+        bool ordered = true;
+        for(auto & line : tagged_lines(path, "ordering ")) {
+            int t = -1, i = -1;
+            sscanf(line.c_str(), "ordering %d %d", &t, &i);
+            ordered &= t >= 0 && t < threads && i == next[t]++;
+        }
+        assert(ordered);
+        for(auto & it : next) {
+            assert(it == records);
+        }
+        log("OK");
+    }
+    {
+        log("a full ring holds the producer back without losing records");
+        std::string pad(200, 'x');
+        std::string huge(UNPAUSE_LOG_BUFFER_SIZE, 'y');
+        const int records = 20000;
+        for(int i = 0 ; i < records ; i++) {
+            DInfo("overflow %d %s", i, pad.c_str());
+            if(i == records / 2) {
+                // too large for the ring, written in place after the earlier ones
+                DInfo("overflow huge %s", huge.c_str());
+            }
+        }
+        unpause::log::flush();
+        auto lines = tagged_lines(path, "overflow ");
+        log_v("%d lines", (int)lines.size());
+        assert(lines.size() == static_cast<std::size_t>(records + 1));
+        int expected = 0;
+        for(auto & line : lines) {
+            if(line.compare(0, 14, "overflow huge ") == 0) {
+                assert(expected == records / 2 + 1);
+                assert(line.size() == 14 + huge.size());
+                continue;
+            }
+            assert(atoi(line.c_str() + 9) == expected);
+            expected++;
+        }
+        log("OK");
+    }
+    {
+        log("a record logged while the writer is idle is written without flush()");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        DInfo("idle %d", 0);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while(tagged_lines(path, "idle ").empty() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(in_sequence(path, "idle ", 1));
+        log("OK");
+    }
+    {
+        log("records still queued at exit are written");
+        std::string out = std::string(path) + ".exit";
+        std::string cmd = std::string(self) + " exit 2> " + out;
+        int res = system(cmd.c_str());
+        log_v("res=%d", res);
+        assert(res == 0);
+        assert(in_sequence(out, "shutdown ", exit_records));
+        unlink(out.c_str());
+        log("OK");
+    }
+
+    unlink(path);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc > 1 && strcmp(argv[1], "exit") == 0) {
+        // logs and returns without flushing, the writer drains the rings on exit
+        for(int i = 0 ; i < exit_records ; i++) {
+            DInfo("shutdown %d", i);
+        }
+        return 0;
+    }
+
+    log_test(argv[0]);
+
+    return 0;
+}